@@ -0,0 +1,237 @@
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <cstring>
+
+#include "Bench.hpp"
+#include "BlockChain/BlockChain.hpp"
+#include "EncoderDecoder.hpp"
+#include "ClientHandler.hpp"
+
+static constexpr auto MINED_BLOCKS = 8;
+static constexpr Difficulty MAX_BENCH_DIFFICULTY = 20;
+static constexpr auto BATCH_RECORDS = 32;
+static constexpr Idx CHAIN_SIZES[] = {10000, 100000, 1000000};
+
+// Well distributed stand-in for a digest, so chains can be built without mining
+std::string fakeHash(Idx seed){
+  static constexpr char hex[] = "0123456789abcdef";
+  std::string hash(HASH_SIZE, '0');
+  for(int word = 0; word < HASH_SIZE / 16; word++){
+    auto z = (seed + 1) * 0x9E3779B97F4A7C15ull + word;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    for(int i = 0; i < 16; i++){
+      hash[word * 16 + i] = hex[(z >> (i * 4)) & 0xF];
+    }
+  }
+  return hash;
+}
+
+std::vector<Block> makeBlocks(const BlockChain& chain, Idx count){
+  std::vector<Block> blocks;
+  blocks.reserve(count);
+  auto phash = chain.getChash(chain.getLength() - 1);
+  for(Idx idx = chain.getLength(); idx < count; idx++){
+    auto chash = fakeHash(idx);
+    // On schedule, so difficulty never retargets
+    blocks.emplace_back(idx, 0, phash, chash, "record " + std::to_string(idx), idx * BLOCK_INTERVAL, INITIAL_DIFFICULTY);
+    phash = chash;
+  }
+  return blocks;
+}
+
+void benchHashing(BenchRunner& runner){
+  Block block(1, 0, std::string(HASH_SIZE, 'a'), std::string(), std::string(DATA_SIZE, 'd'), 0, INITIAL_DIFFICULTY);
+  runner.run("block_compute_hash", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(block.compute_hash());
+    }
+  }, {{"data_bytes", DATA_SIZE}});
+}
+
+// mine_block time per difficulty, each bit doubling the expected hashes
+void benchMining(BenchRunner& runner){
+  BlockChain chain;
+  for(Difficulty difficulty = MIN_DIFFICULTY; difficulty <= MAX_BENCH_DIFFICULTY; difficulty++){
+    unsigned long long hashes = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < MINED_BLOCKS; i++){
+      const auto next = chain.nextBlock("mined record " + std::to_string(difficulty) + "." + std::to_string(i));
+      Block block(next.get_index(), 0, next.get_phash(), std::string(), next.get_data(), next.get_timestamp(), difficulty);
+      block.mine_block();
+      hashes += block.get_nonce();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    runner.record("mine_block", MINED_BLOCKS, elapsed, {{"difficulty_bits", difficulty}, {"hashes_per_block", double(hashes) / MINED_BLOCKS}});
+  }
+}
+
+// Records/sec through a running node, one addData round trip per record
+// against a single addBatch
+void benchIngest(BenchRunner& runner){
+  std::vector<std::string> records;
+  for(int i = 0; i < BATCH_RECORDS; i++){
+    records.push_back("ingested record " + std::to_string(i));
+  }
+  // A fresh node each, so both start from genesis and meet the same retargets
+  auto measure = [&](const std::string& name, auto&& ingest){
+    ClientHandler node;
+    node.start();
+    auto& hashes = node.getMetrics().counter("hashes_tried");
+    const auto start = std::chrono::steady_clock::now();
+    ingest(node);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    runner.record(name, BATCH_RECORDS, elapsed, {{"records", BATCH_RECORDS}, {"hashes_per_record", double(hashes.value()) / BATCH_RECORDS}});
+    node.stop();
+  };
+  measure("ingest_add_data_loop", [&](ClientHandler& node){
+    for(const auto& record : records){
+      node.addData(record).get();
+    }
+  });
+  measure("ingest_add_batch", [&](ClientHandler& node){
+    node.addBatch(records).get();
+  });
+}
+
+void benchChain(BenchRunner& runner, Idx size){
+  const double blocks = size;
+  BlockChain chain;
+  auto pending = makeBlocks(chain, size);
+  runner.runOnce("chain_append", pending.size(), [&](auto){
+    for(const auto& block : pending){
+      chain.appendBlock(block);
+    }
+  }, {{"blocks", blocks}});
+  pending.clear();
+  pending.shrink_to_fit();
+
+  std::mt19937_64 rng(size);
+  runner.run("chain_get_block", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(chain.getBlock(rng() % size));
+    }
+  }, {{"blocks", blocks}});
+
+  runner.run("chain_get_block_ref", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(chain.getBlockRef(rng() % size));
+    }
+  }, {{"blocks", blocks}});
+
+  runner.run("chain_get_chash", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(chain.getChash(rng() % size));
+    }
+  }, {{"blocks", blocks}});
+
+  std::vector<std::string> hashes;
+  for(int i = 0; i < 4096; i++){
+    hashes.push_back(fakeHash(1 + rng() % (size - 1)));
+  }
+  runner.run("chain_find_chash", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(chain.findChash(hashes[i % hashes.size()]));
+    }
+  }, {{"blocks", blocks}});
+
+  // Every record holds its index as a word
+  std::vector<std::string> words;
+  for(int i = 0; i < 4096; i++){
+    words.push_back(std::to_string(1 + rng() % (size - 1)));
+  }
+  runner.run("chain_find_data", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(chain.findData(words[i % words.size()], FIND_LIMIT));
+    }
+  }, {{"blocks", blocks}});
+
+  runner.run("chain_find_data_prefix", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(chain.findData(words[i % words.size()] + "*", FIND_LIMIT));
+    }
+  }, {{"blocks", blocks}});
+
+  // An intact chain, so this is the link check alone
+  runner.runOnce("chain_repair_scan", size, [&](auto){
+    chain.repairChain();
+  }, {{"blocks", blocks}});
+}
+
+void benchEncoding(BenchRunner& runner){
+  EncoderDecoder encoder;
+  char buffer[sizeof(ResponseDataMessage)];
+  const auto hash = fakeHash(7);
+  const auto data = std::string(DATA_SIZE, 'd');
+
+  runner.run("encode_connect", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.encodeConnectMsg(buffer, 50000, 50001));
+    }
+  });
+  runner.run("encode_request_chash", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.encodeRequestChashMsg(buffer, 50000, 50001, i));
+    }
+  });
+  runner.run("encode_response_chash", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.encodeResponseHashMsg(buffer, 50000, 50001, i, i, hash));
+    }
+  });
+  runner.run("encode_request_data", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.encodeRequestDataMsg(buffer, 50000, 50001, i, hash));
+    }
+  });
+  runner.run("encode_response_data", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.encodeResponseDataMsg(buffer, 50000, 50001, i, i, i, INITIAL_DIFFICULTY, hash, hash, data));
+    }
+  });
+
+  encoder.encodeResponseHashMsg(buffer, 50000, 50001, 1, 1, hash);
+  runner.run("decode_response_chash", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.decodeResponseChashMsg(buffer));
+    }
+  });
+  encoder.encodeRequestDataMsg(buffer, 50000, 50001, 1, hash);
+  runner.run("decode_request_data", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.decodeRequestDataMsg(buffer));
+    }
+  });
+  encoder.encodeResponseDataMsg(buffer, 50000, 50001, 1, 1, 1, INITIAL_DIFFICULTY, hash, hash, data);
+  runner.run("decode_response_data", [&](auto n){
+    for(decltype(n) i = 0; i < n; i++){
+      doNotOptimize(encoder.decodeResponseDataMsg(buffer));
+    }
+  });
+}
+
+int main(int argc, char const *argv[]) {
+  std::string out = "bench.json";
+  Idx max_blocks = CHAIN_SIZES[std::size(CHAIN_SIZES) - 1];
+  for(int i = 1; i + 1 < argc; i += 2){
+    if(std::strcmp(argv[i], "--out") == 0) out = argv[i + 1];
+    else if(std::strcmp(argv[i], "--max-blocks") == 0) max_blocks = std::stoull(argv[i + 1]);
+  }
+
+  Logger::setLevel(LogLevel::Error);
+  BenchRunner runner;
+  benchHashing(runner);
+  benchMining(runner);
+  benchIngest(runner);
+  for(auto size : CHAIN_SIZES){
+    if(size <= max_blocks) benchChain(runner, size);
+  }
+  benchEncoding(runner);
+
+  std::ofstream file(out);
+  runner.writeJson(file);
+  runner.writeJson(std::cout);
+  return 0;
+}
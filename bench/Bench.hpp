@@ -0,0 +1,89 @@
+#ifndef __BENCH_HPP__
+#define __BENCH_HPP__
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+#include <ostream>
+#include <iomanip>
+
+// Keeps the compiler from discarding a value computed only for timing
+template<typename T>
+inline void doNotOptimize(const T& value){
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class BenchRunner {
+
+  using Clock = std::chrono::steady_clock;
+  using Params = std::vector<std::pair<std::string, double>>;
+
+  struct Result {
+    std::string name;
+    unsigned long long iterations;
+    double ns_per_op;
+    Params params;
+  };
+
+private:
+
+  std::vector<Result> results;
+  std::chrono::nanoseconds min_time;
+
+public:
+
+  explicit BenchRunner(std::chrono::milliseconds _min_time = std::chrono::milliseconds(200)) : min_time(_min_time) {}
+
+  // fn(n) performs the operation n times, n doubles until a run lasts min_time
+  template<typename F>
+  void run(const std::string& name, F&& fn, Params params = {}){
+    unsigned long long iterations = 1;
+    while(true){
+      const auto elapsed = time(fn, iterations);
+      if(elapsed >= min_time || iterations >= (1ull << 40)){
+        record(name, iterations, elapsed, std::move(params));
+        return;
+      }
+      iterations *= 2;
+    }
+  }
+
+  // Times exactly `iterations` operations, for work too expensive to repeat
+  template<typename F>
+  void runOnce(const std::string& name, unsigned long long iterations, F&& fn, Params params = {}){
+    record(name, iterations, time(fn, iterations), std::move(params));
+  }
+
+  void record(const std::string& name, unsigned long long iterations, std::chrono::nanoseconds elapsed, Params params = {}){
+    results.push_back(Result{name, iterations, double(elapsed.count()) / iterations, std::move(params)});
+  }
+
+  void writeJson(std::ostream& out) const {
+    out << "{\n  \"benchmarks\": [\n";
+    for(std::size_t i = 0; i < results.size(); i++){
+      const auto& r = results[i];
+      out << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+          << std::fixed << std::setprecision(2)
+          << ", \"ns_per_op\": " << r.ns_per_op
+          << ", \"ops_per_sec\": " << (r.ns_per_op > 0 ? 1e9 / r.ns_per_op : 0);
+      for(const auto& [key, value] : r.params){
+        out << ", \"" << key << "\": " << value;
+      }
+      out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+  }
+
+private:
+
+  template<typename F>
+  std::chrono::nanoseconds time(F& fn, unsigned long long iterations){
+    const auto start = Clock::now();
+    fn(iterations);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+  }
+
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <memory>
+#include <span>
+#include <cstring>
+#include <algorithm>
+
+#include "ClientHandler.hpp"
+
+// Headless loopback cluster: N nodes in this process, data added at a fixed
+// rate on random nodes, block propagation observed through the block listener.
+// Optionally the first node is then flooded with chash requests from many
+// ports, to measure how request serving scales with its listeners.
+
+using Clock = std::chrono::steady_clock;
+
+struct ClusterConfig {
+  int nodes = 4;
+  unsigned listeners = 1;   // receive sockets per node
+  TransportKind transport = TransportKind::Socket;
+  double rate = 2;          // blocks per second across the cluster
+  double duration = 10;     // seconds of load
+  double timeout = 60;      // seconds to wait for convergence after the load stops
+  std::string out = "cluster.json";
+  double flood = 0;         // seconds of chash requests at the first node after convergence, 0 skips
+  int flood_peers = 64;     // ports the requests come from, each paced to PEER_REQUEST_RATE
+};
+
+// Chash requests sent and answers received by the flood
+struct FloodResult {
+  unsigned long long sent = 0;
+  unsigned long long served = 0;
+  double seconds = 0;
+};
+
+// Flood peers per thread
+static constexpr auto FLOOD_PEERS_PER_THREAD = 8;
+// Requests each flood peer sends per tick
+static constexpr auto FLOOD_TICK = std::chrono::milliseconds(10);
+
+class Cluster {
+
+private:
+
+  ClusterConfig config;
+  std::vector<std::unique_ptr<ClientHandler>> nodes;
+
+  std::mutex seen_mutex;
+  // chash -> first time any node had it on its main chain, and how many nodes have seen it
+  std::unordered_map<std::string, std::pair<Clock::time_point, int>> first_seen;
+  std::unordered_map<std::string, std::unordered_set<int>> seen_by;
+  std::vector<double> latencies_ms;
+
+public:
+
+  explicit Cluster(ClusterConfig _config) : config(std::move(_config)) {
+    for(int i = 0; i < config.nodes; i++){
+      nodes.emplace_back(std::make_unique<ClientHandler>(config.listeners, config.transport));
+      nodes.back()->setBlockListener([this, i](Idx, const std::string& chash){ onBlock(i, chash); });
+    }
+  }
+
+  void run(){
+    for(auto& node : nodes){
+      node->start();
+    }
+
+    const auto t0 = Clock::now();
+    const auto before = totals();
+    std::mt19937 rng(42);
+    std::vector<std::future<Idx>> pending;
+    const auto interval = std::chrono::duration<double>(1.0 / config.rate);
+    auto next = t0;
+    for(int i = 0; Clock::now() - t0 < std::chrono::duration<double>(config.duration); i++){
+      std::this_thread::sleep_until(next);
+      next += std::chrono::duration_cast<Clock::duration>(interval);
+      pending.push_back(nodes[rng() % nodes.size()]->addData("record " + std::to_string(i)));
+    }
+    for(auto& p : pending){
+      p.get();
+    }
+    const auto loadEnd = Clock::now();
+
+    const bool converged = waitForConvergence();
+    const auto end = Clock::now();
+    const auto after = totals();
+
+    const auto flooded = config.flood > 0 ? flood() : FloodResult{};
+
+    for(auto& node : nodes){
+      node->stop();
+    }
+
+    report(pending.size(), std::chrono::duration<double>(end - t0).count(), std::chrono::duration<double, std::milli>(end - loadEnd).count(), converged, after.first - before.first, after.second - before.second, flooded);
+  }
+
+private:
+
+  void onBlock(int node, const std::string& chash){
+    const auto now = Clock::now();
+    std::scoped_lock seen_lock(seen_mutex);
+    if(!seen_by[chash].insert(node).second) return;
+    auto [f_it, inserted] = first_seen.try_emplace(chash, now, 0);
+    if(!inserted){
+      latencies_ms.push_back(std::chrono::duration<double, std::milli>(now - f_it->second.first).count());
+    }
+    f_it->second.second++;
+  }
+
+  // Every flood peer asks the first node for random chashes at the rate its
+  // request budget allows, so nothing is throttled and what is not answered
+  // was more than the node could serve
+  FloodResult flood(){
+    // Addresses are resolved up front, gethostbyname is not thread safe
+    sockaddr_in target;
+    fillAddr(IP_ADDR, nodes.front()->getReceivePort(), target);
+    std::vector<std::unique_ptr<UDPSocket>> peers;
+    for(int p = 0; p < config.flood_peers; p++){
+      peers.push_back(std::make_unique<UDPSocket>(IP_ADDR, 0));
+    }
+    const auto length = nodes.front()->getLength();
+    const auto per_tick = std::max(1, int(PEER_REQUEST_RATE * std::chrono::duration<double>(FLOOD_TICK).count()));
+    const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.flood));
+    std::atomic<unsigned long long> sent{0}, served{0};
+    std::vector<std::thread> threads;
+    for(int first = 0; first < config.flood_peers; first += FLOOD_PEERS_PER_THREAD){
+      const auto count = std::min(FLOOD_PEERS_PER_THREAD, config.flood_peers - first);
+      threads.emplace_back([&, count, first](){
+        EncoderDecoder encoder;
+        const auto own = std::span(peers).subspan(first, count);
+        std::mt19937 rng(first);
+        char frame[BUFFER_SIZE];
+        auto next = Clock::now();
+        while(Clock::now() < deadline){
+          for(auto& peer : own){
+            for(int r = 0; r < per_tick; r++){
+              const int len = encoder.encodeRequestChashMsg(frame, peer->getLocalPort(), peer->getLocalPort(), Idx(rng() % length));
+              peer->sendTo(frame, len, target);
+              sent++;
+            }
+          }
+          next += FLOOD_TICK;
+          do{
+            for(auto& peer : own){
+              while(peer->recv(frame, sizeof(frame), MSG_DONTWAIT) > 0){
+                if(((MessageHeader *)frame)->msgType == MessageType::ResponseChashMsg) served++;
+              }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }while(Clock::now() < next);
+        }
+      });
+    }
+    const auto start = Clock::now();
+    for(auto& thread : threads){
+      thread.join();
+    }
+    return FloodResult{sent, served, std::chrono::duration<double>(Clock::now() - start).count()};
+  }
+
+  bool waitForConvergence(){
+    const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.timeout));
+    while(Clock::now() < deadline){
+      const auto length = nodes.front()->getLength();
+      const auto tip = nodes.front()->getChash(length - 1);
+      if(std::all_of(nodes.begin(), nodes.end(), [&](auto& node){ return node->getLength() == length && node->getChash(length - 1) == tip; })){
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  }
+
+  std::pair<unsigned long long, unsigned long long> totals() const {
+    unsigned long long msgs = 0, bytes = 0;
+    for(const auto& node : nodes){
+      msgs += node->getMetrics().counter("msgs_out").value();
+      bytes += node->getMetrics().counter("bytes_out").value();
+    }
+    return {msgs, bytes};
+  }
+
+  double percentile(std::vector<double>& values, double p) const {
+    if(values.empty()) return 0;
+    const auto rank = std::min(values.size() - 1, std::size_t(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+  }
+
+  void report(std::size_t blocks, double seconds, double convergence_ms, bool converged, unsigned long long msgs, unsigned long long bytes, const FloodResult& flooded){
+    std::scoped_lock seen_lock(seen_mutex);
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(2)
+         << "{\n"
+         << "  \"nodes\": " << config.nodes << ",\n"
+         << "  \"listeners\": " << config.listeners << ",\n"
+         << "  \"transport\": \"" << (config.transport == TransportKind::IoUring ? "uring" : "socket") << "\",\n"
+         << "  \"rate\": " << config.rate << ",\n"
+         << "  \"blocks\": " << blocks << ",\n"
+         << "  \"latency_ms\": {\"samples\": " << latencies_ms.size()
+         << ", \"p50\": " << percentile(latencies_ms, 0.50)
+         << ", \"p90\": " << percentile(latencies_ms, 0.90)
+         << ", \"p99\": " << percentile(latencies_ms, 0.99)
+         << ", \"max\": " << percentile(latencies_ms, 1.0) << "},\n"
+         << "  \"messages_per_sec\": " << msgs / seconds << ",\n"
+         << "  \"bytes_per_sec\": " << bytes / seconds << ",\n"
+         << "  \"converged\": " << (converged ? "true" : "false") << ",\n"
+         << "  \"convergence_ms\": " << convergence_ms;
+    if(flooded.seconds > 0){
+      json << ",\n"
+           << "  \"flood\": {\"peers\": " << config.flood_peers
+           << ", \"offered_per_sec\": " << flooded.sent / flooded.seconds
+           << ", \"served_per_sec\": " << flooded.served / flooded.seconds << "}";
+    }
+    json << "\n}\n";
+    std::ofstream(config.out) << json.str();
+    std::cout << json.str();
+  }
+
+};
+
+int main(int argc, char const *argv[]) {
+  ClusterConfig config;
+  for(int i = 1; i + 1 < argc; i += 2){
+    if(std::strcmp(argv[i], "--nodes") == 0) config.nodes = std::stoi(argv[i + 1]);
+    else if(std::strcmp(argv[i], "--listeners") == 0) config.listeners = std::stoul(argv[i + 1]);
+    else if(std::strcmp(argv[i], "--transport") == 0) config.transport = std::strcmp(argv[i + 1], "uring") == 0 ? TransportKind::IoUring : TransportKind::Socket;
+    else if(std::strcmp(argv[i], "--rate") == 0) config.rate = std::stod(argv[i + 1]);
+    else if(std::strcmp(argv[i], "--duration") == 0) config.duration = std::stod(argv[i + 1]);
+    else if(std::strcmp(argv[i], "--timeout") == 0) config.timeout = std::stod(argv[i + 1]);
+    else if(std::strcmp(argv[i], "--out") == 0) config.out = argv[i + 1];
+    else if(std::strcmp(argv[i], "--flood") == 0) config.flood = std::stod(argv[i + 1]);
+    else if(std::strcmp(argv[i], "--flood-peers") == 0) config.flood_peers = std::stoi(argv[i + 1]);
+  }
+  Cluster cluster(config);
+  cluster.run();
+  return 0;
+}
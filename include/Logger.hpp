@@ -0,0 +1,283 @@
+#ifndef __LOGGER_HPP__
+#define __LOGGER_HPP__
+
+#include <array>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <iostream>
+#include <streambuf>
+#include <condition_variable>
+
+#include <signal.h>
+
+// Numeric levels so log.h can compare them in #if
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF 5
+
+enum class LogLevel : int {
+  Debug = LOG_LEVEL_DEBUG,
+  Info = LOG_LEVEL_INFO,
+  Warn = LOG_LEVEL_WARN,
+  Error = LOG_LEVEL_ERROR,
+  Off = LOG_LEVEL_OFF
+};
+
+static constexpr auto LOG_LINE_SIZE = 240;
+static constexpr auto LOG_RING_SLOTS = 256;
+static constexpr auto LOG_WRITER_INTERVAL = std::chrono::milliseconds(10);
+
+// Single producer (the owning thread), single consumer (the writer thread)
+class LogRing {
+
+  struct Record {
+    LogLevel level;
+    int line;
+    const char *file;
+    unsigned short len;
+    char text[LOG_LINE_SIZE];
+  };
+
+private:
+
+  std::array<Record, LOG_RING_SLOTS> records;
+  std::atomic<std::size_t> head{0};
+  std::atomic<std::size_t> tail{0};
+
+public:
+
+  std::atomic<std::size_t> dropped{0};
+
+  // Never blocks, a full ring drops the record
+  void push(LogLevel level, const char *file, int line, const char *text, std::size_t len){
+    const auto t = tail.load(std::memory_order_relaxed);
+    if(t - head.load(std::memory_order_acquire) == LOG_RING_SLOTS){
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    auto& r = records[t % LOG_RING_SLOTS];
+    r.level = level;
+    r.file = file;
+    r.line = line;
+    r.len = std::min<std::size_t>(len, LOG_LINE_SIZE);
+    std::memcpy(r.text, text, r.len);
+    tail.store(t + 1, std::memory_order_release);
+  }
+
+  template<typename F>
+  bool drain(F&& fn){
+    auto h = head.load(std::memory_order_relaxed);
+    const auto t = tail.load(std::memory_order_acquire);
+    for(; h != t; h++){
+      fn(records[h % LOG_RING_SLOTS]);
+    }
+    head.store(h, std::memory_order_release);
+    return h != t;
+  }
+
+};
+
+// Fixed per-thread line buffer, output past LOG_LINE_SIZE is truncated
+class LogLineBuffer : public std::streambuf {
+
+private:
+
+  char line[LOG_LINE_SIZE];
+
+public:
+
+  LogLineBuffer(){
+    setp(line, line + LOG_LINE_SIZE);
+  }
+
+  const char *data() const {
+    return pbase();
+  }
+
+  std::size_t size() const {
+    return pptr() - pbase();
+  }
+
+  void reset(){
+    setp(line, line + LOG_LINE_SIZE);
+  }
+
+protected:
+
+  int_type overflow(int_type) override {
+    return traits_type::eof();
+  }
+
+};
+
+// Log statements format on the calling thread into its own ring, a
+// background thread writes the rings to stdout.
+class Logger {
+
+  struct ThreadState {
+    LogLineBuffer buffer;
+    std::ostream stream{&buffer};
+    std::shared_ptr<LogRing> ring = std::make_shared<LogRing>();
+
+    ThreadState(){
+      Logger::instance().attach(ring);
+    }
+  };
+
+private:
+
+  std::atomic<int> level{LOG_LEVEL_DEBUG};
+  std::atomic<std::ostream*> output{&std::cout};
+
+  std::mutex rings_mutex;
+  std::vector<std::shared_ptr<LogRing>> rings;
+
+  std::mutex writer_mutex;
+  std::condition_variable writer_cv;
+  bool running = true;
+  std::thread writer;
+
+  Logger(){
+    writer = std::thread([this](){ write(); });
+  }
+
+public:
+
+  ~Logger(){
+    {
+      std::scoped_lock writer_lock(writer_mutex);
+      running = false;
+    }
+    writer_cv.notify_all();
+    writer.join();
+  }
+
+  static Logger& instance(){
+    static Logger logger;
+    return logger;
+  }
+
+  static bool enabled(LogLevel l){
+    return static_cast<int>(l) >= instance().level.load(std::memory_order_relaxed);
+  }
+
+  static void setLevel(LogLevel l){
+    instance().level.store(static_cast<int>(l), std::memory_order_relaxed);
+  }
+
+  // Where the writer thread sends log lines, stdout by default
+  static void setOutput(std::ostream& out){
+    instance().output.store(&out);
+  }
+
+  static std::ostream& stream(){
+    return state().stream;
+  }
+
+  // Moves the line formatted into stream() onto this thread's ring
+  static void commit(LogLevel l, const char *file, int line){
+    auto& s = state();
+    s.ring->push(l, file, line, s.buffer.data(), s.buffer.size());
+    s.buffer.reset();
+    s.stream.clear();
+  }
+
+  // Throws std::invalid_argument for an unknown name, so a typo does not silence the log
+  static LogLevel parseLevel(const std::string& name){
+    if(name == "debug") return LogLevel::Debug;
+    if(name == "info") return LogLevel::Info;
+    if(name == "warn") return LogLevel::Warn;
+    if(name == "error") return LogLevel::Error;
+    if(name == "off") return LogLevel::Off;
+    throw std::invalid_argument("unknown log level " + name);
+  }
+
+private:
+
+  static ThreadState& state(){
+    static thread_local ThreadState s;
+    return s;
+  }
+
+  void attach(std::shared_ptr<LogRing> ring){
+    std::scoped_lock rings_lock(rings_mutex);
+    rings.push_back(std::move(ring));
+  }
+
+  static const char *levelName(LogLevel l){
+    switch(l){
+      case LogLevel::Debug: return "Debug";
+      case LogLevel::Info: return "Info";
+      case LogLevel::Warn: return "Warn";
+      case LogLevel::Error: return "ERROR";
+      default: return "";
+    }
+  }
+
+  void write(){
+    // Signals are left to the application's threads
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::string out;
+    while(true){
+      bool stopping;
+      {
+        std::unique_lock writer_lock(writer_mutex);
+        writer_cv.wait_for(writer_lock, LOG_WRITER_INTERVAL, [this](){ return !running; });
+        stopping = !running;
+      }
+      flush(out);
+      if(stopping) break;
+    }
+  }
+
+  // Drains and writes outside rings_mutex, so a thread attaching its first
+  // ring never waits on the output stream
+  void flush(std::string& out){
+    std::vector<std::shared_ptr<LogRing>> current;
+    {
+      std::scoped_lock rings_lock(rings_mutex);
+      current = rings;
+    }
+    std::vector<LogRing*> orphans;
+    for(const auto& ring : current){
+      // Held by rings and current alone once its thread exited, released when drained
+      const bool orphaned = ring.use_count() == 2;
+      ring->drain([&out](const auto& r){
+        out.append(levelName(r.level)).append(": ").append(r.file).append(":").append(std::to_string(r.line)).append(" : ");
+        out.append(r.text, r.len).append("\n");
+      });
+      if(const auto dropped = ring->dropped.exchange(0)){
+        out.append("Logger: ").append(std::to_string(dropped)).append(" messages dropped\n");
+      }
+      if(orphaned){
+        orphans.push_back(ring.get());
+      }
+    }
+    if(!out.empty()){
+      auto& os = *output.load();
+      os.write(out.data(), out.size());
+      os.flush();
+      out.clear();
+    }
+    if(!orphans.empty()){
+      std::scoped_lock rings_lock(rings_mutex);
+      std::erase_if(rings, [&orphans](const auto& ring){ return std::find(orphans.begin(), orphans.end(), ring.get()) != orphans.end(); });
+    }
+  }
+
+};
+
+#endif
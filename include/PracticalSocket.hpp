@@ -17,6 +17,7 @@
   #include <netdb.h>           // For gethostbyname()
   #include <arpa/inet.h>       // For inet_addr()
   #include <unistd.h>          // For close()
+  #include <sys/time.h>        // For timeval
   #include <netinet/in.h>      // For sockaddr_in
   typedef void raw_type;       // Type used for raw data on this platform
 #endif
@@ -130,6 +131,34 @@ public:
     }
   }
 
+  /**
+   *   Get the underlying socket descriptor
+   *   @return socket descriptor
+   */
+  int getDescriptor() const {
+    return sockDesc;
+  }
+
+  /**
+   *   Shut down both directions of the socket, waking any thread blocked
+   *   in accept() or recv() on it
+   */
+  void shutdown() {
+    ::shutdown(sockDesc, SHUT_RDWR);
+  }
+
+  /**
+   *   Make a blocking recv() on this socket give up after a while, returning -1
+   *   @param millis longest wait in milliseconds, 0 waits forever
+   *   @exception SocketException thrown if the timeout cannot be set
+   */
+  void setRecvTimeout(long millis) {
+    timeval timeout{millis / 1000, (millis % 1000) * 1000};
+    if (setsockopt(sockDesc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+      throw SocketException("Set of SO_RCVTIMEO failed (setsockopt())", true);
+    }
+  }
+
   static void cleanUp() {
     #ifdef WIN32
       if (WSACleanup() != 0) {
@@ -213,10 +242,11 @@ public:
    *   calling send()
    *   @param buffer buffer to be written
    *   @param bufferLen number of bytes from buffer to be written
+   *   @param flag flags passed through to send()
    *   @exception SocketException thrown if unable to send data
    */
-  void send(const void *buffer, int bufferLen) {
-    if (::send(sockDesc, (raw_type *) buffer, bufferLen, 0) < 0) {
+  void send(const void *buffer, int bufferLen, int flag=0) {
+    if (::send(sockDesc, (raw_type *) buffer, bufferLen, flag) < 0) {
       throw SocketException("Send failed (send())", true);
     }
   }
@@ -389,9 +419,17 @@ public:
   /**
    *   Construct a UDP socket with the given local port
    *   @param localPort local port
+   *   @param reusePort let other sockets with reusePort bind the same port,
+   *                    the kernel then spreads incoming datagrams across them
    *   @exception SocketException thrown if unable to create UDP socket
    */
-  UDPSocket(unsigned short localPort) : CommunicatingSocket(SOCK_DGRAM, IPPROTO_UDP) {
+  UDPSocket(unsigned short localPort, bool reusePort = false) : CommunicatingSocket(SOCK_DGRAM, IPPROTO_UDP) {
+    if (reusePort) {
+      int so_reuseport = 1;
+      if (setsockopt(sockDesc, SOL_SOCKET, SO_REUSEPORT, &so_reuseport, sizeof(so_reuseport)) < 0) {
+        throw SocketException("Set of SO_REUSEPORT failed (setsockopt())", true);
+      }
+    }
     setLocalPort(localPort);
     int optval = 1;
     setsockopt(sockDesc, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
@@ -454,6 +492,19 @@ public:
     }
   }
 
+  /**
+   *   Send the given buffer as a UDP datagram to an already resolved address
+   *   @param buffer buffer to be written
+   *   @param bufferLen number of bytes to write
+   *   @param destAddr address and port to send to
+   *   @exception SocketException thrown if unable to send datagram
+   */
+  void sendTo(const void *buffer, int bufferLen, const sockaddr_in &destAddr) {
+    if (sendto(sockDesc, (raw_type *) buffer, bufferLen, 0, (const sockaddr *) &destAddr, sizeof(destAddr)) != bufferLen) {
+      throw SocketException("Send failed (sendto())", true);
+    }
+  }
+
   /**
    *   Read read up to bufferLen bytes data from this socket.  The given buffer
    *   is where the data will be placed
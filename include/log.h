@@ -1,41 +1,82 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
-#define LOGGING 1
-#define DEBUG 1
-#define ERROR 1
+#include "Logger.hpp"
 
-// log macros
+// Levels below LOG_LEVEL are compiled out, e.g. -DLOG_LEVEL=LOG_LEVEL_ERROR
+#ifndef LOG_LEVEL
+  #define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#ifndef LOGGING
+  #define LOGGING (LOG_LEVEL < LOG_LEVEL_OFF)
+#endif
+#ifndef DEBUG
+  #define DEBUG (LOG_LEVEL <= LOG_LEVEL_DEBUG)
+#endif
+#ifndef INFO
+  #define INFO (LOG_LEVEL <= LOG_LEVEL_INFO)
+#endif
+#ifndef WARN
+  #define WARN (LOG_LEVEL <= LOG_LEVEL_WARN)
+#endif
+#ifndef ERROR
+  #define ERROR (LOG_LEVEL <= LOG_LEVEL_ERROR)
+#endif
+
+// log macros, formatting only happens when the level is enabled at runtime
 #if LOGGING
-  #define logging(type, x) std::cout<<type<<": "<<__FILE__<<":"<<__LINE__<<" : "<<#x<<"="<<x<<std::endl
-  #define logging_arr(type, arr) std::cout<<type<<": "<<__FILE__<<":"<<__LINE__<<" : "<<#arr<<"={ ";for(int i=0; i<size_arr(arr); i++) std::cout<<arr[i]<<" "; print("}")
-  #define logging_msg(type, x) std::cout<<type<<": "<<__FILE__<<":"<<__LINE__<<" : "<<x<<std::endl
+  #define logging_msg(level, x) do{ if(Logger::enabled(level)){ Logger::stream()<<x; Logger::commit(level, __FILE__, __LINE__); } }while(0)
+  #define logging(level, x) logging_msg(level, #x<<"="<<x)
+  #define logging_arr(level, arr) do{ if(Logger::enabled(level)){ Logger::stream()<<#arr<<"={ "; for(const auto& e : arr) Logger::stream()<<e<<" "; Logger::stream()<<"}"; Logger::commit(level, __FILE__, __LINE__); } }while(0)
 #else
-  #define logging(type, x) // no logging
-  #define logging_arr(type, a) // no logging
-  #define logging_msg(type, x) // no logging
+  #define logging(level, x) do{}while(0)
+  #define logging_arr(level, a) do{}while(0)
+  #define logging_msg(level, x) do{}while(0)
 #endif
 
 // Debug macros
-#if DEBUG
-  #define debug(x) logging("Debug", x)
-  #define debug_arr(arr) logging_arr("Debug", arr)
-  #define dmsg(x) logging_msg("Debug", x)
+#if LOGGING && DEBUG
+  #define debug(x) logging(LogLevel::Debug, x)
+  #define debug_arr(arr) logging_arr(LogLevel::Debug, arr)
+  #define dmsg(x) logging_msg(LogLevel::Debug, x)
+#else
+  #define debug(x) do{}while(0)
+  #define debug_arr(a) do{}while(0)
+  #define dmsg(x) do{}while(0)
+#endif
+
+// Info macros
+#if LOGGING && INFO
+  #define info(x) logging(LogLevel::Info, x)
+  #define info_arr(arr) logging_arr(LogLevel::Info, arr)
+  #define imsg(x) logging_msg(LogLevel::Info, x)
+#else
+  #define info(x) do{}while(0)
+  #define info_arr(a) do{}while(0)
+  #define imsg(x) do{}while(0)
+#endif
+
+// Warning macros
+#if LOGGING && WARN
+  #define warn(x) logging(LogLevel::Warn, x)
+  #define warn_arr(arr) logging_arr(LogLevel::Warn, arr)
+  #define wmsg(x) logging_msg(LogLevel::Warn, x)
 #else
-  #define debug(x) // no debug
-  #define debug_arr(a) // no debug
-  #define dmsg(x) // no debug
+  #define warn(x) do{}while(0)
+  #define warn_arr(a) do{}while(0)
+  #define wmsg(x) do{}while(0)
 #endif
 
 // Error macros
-#if ERROR
-  #define error(x) logging("ERROR", x)
-  #define error_arr(arr) logging_arr("ERROR", arr)
-  #define err(x) logging_msg("ERROR", x)
+#if LOGGING && ERROR
+  #define error(x) logging(LogLevel::Error, x)
+  #define error_arr(arr) logging_arr(LogLevel::Error, arr)
+  #define err(x) logging_msg(LogLevel::Error, x)
 #else
-  #define error(x) // no error
-  #define error_arr(a) // no error
-  #define err(x) // no error
+  #define error(x) do{}while(0)
+  #define error_arr(a) do{}while(0)
+  #define err(x) do{}while(0)
 #endif
 
 
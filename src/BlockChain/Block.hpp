@@ -1,8 +1,15 @@
 #ifndef __BLOCK_HPP__
 #define __BLOCK_HPP__
 
+#include <array>
 #include <string>
-#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <stdexcept>
+#include <string_view>
 
 #include <openssl/sha.h>
 
@@ -10,9 +17,33 @@
 
 static constexpr auto HASH_SIZE = 64;
 static constexpr auto DATA_SIZE = 256;
+static constexpr auto DIGEST_SIZE = SHA256_DIGEST_LENGTH;
 
 using Idx = unsigned long long int;
 using Nonce = unsigned long long int;
+// Milliseconds since the Unix epoch
+using Timestamp = std::uint64_t;
+// Number of low digest bits that must match MINING_PATTERN
+using Difficulty = unsigned int;
+
+// The low bits of the last eight digest bytes must match this pattern. At
+// INITIAL_DIFFICULTY that is the "1234" hex suffix of a chash.
+static constexpr std::uint64_t MINING_PATTERN = 0x1234123412341234ull;
+static constexpr Difficulty INITIAL_DIFFICULTY = 16;
+static constexpr Difficulty MIN_DIFFICULTY = 4;
+static constexpr Difficulty MAX_DIFFICULTY = 40;
+
+// Expected hashes to mine a block at difficulty
+constexpr unsigned long long int difficultyWork(Difficulty difficulty){
+  return 1ull << difficulty;
+}
+
+inline Timestamp currentTime(){
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// SHA-256 of everything a block hashes before its nonce
+using WorkKey = std::array<unsigned char, DIGEST_SIZE>;
 
 
 class Block{
@@ -21,35 +52,76 @@ private:
 
   Idx index;
   Nonce nonce;
+  Timestamp timestamp = 0;
+  Difficulty difficulty = INITIAL_DIFFICULTY;
   char phash[HASH_SIZE] = {0};
   char chash[HASH_SIZE] = {0};
   char data[DATA_SIZE] = {0};
 
 public:
 
-  Block(const Idx _idx, const std::string _phash, const std::string& _data) : index(_idx){
-    if(_data.size() > DATA_SIZE){
-      throw "Size of input data is more than block data section";
-    }
+  // Mined at INITIAL_DIFFICULTY with timestamp 0, as the genesis block is
+  Block(const Idx _idx, const std::string _phash, const std::string& _data) : index(_idx), nonce(0){
+    check_data(_data);
     _phash.copy(phash, _phash.size());
     _data.copy(data, _data.size());
     mine_block();
   }
 
-  Block(const Idx _idx, const Nonce _nonce, const std::string& _phash, const std::string& _chash, const std::string& _data): index(_idx), nonce(_nonce){
+  Block(const Idx _idx, const Nonce _nonce, const std::string& _phash, const std::string& _chash, const std::string& _data, Timestamp _timestamp, Difficulty _difficulty): index(_idx), nonce(_nonce), timestamp(_timestamp), difficulty(_difficulty){
+    check_data(_data);
     _phash.copy(phash, _phash.size());
     _chash.copy(chash, _chash.size());
     _data.copy(data, _data.size());
   }
 
-  void mine_block(bool force=false){
-    if(force) hash_it();
-    while(!is_mined()){
-      nonce++;
-      hash_it();
+  // Throws std::invalid_argument when _data does not fit a block
+  static void check_data(std::string_view _data){
+    if(_data.size() > DATA_SIZE){
+      throw std::invalid_argument("Size of input data is more than block data section");
     }
   }
 
+  void mine_block(bool force=false){
+    search(nullptr, force);
+  }
+
+  // Returns false if cancel was raised before a nonce was found
+  bool mine_block(const std::atomic<bool>& cancel, bool force=false){
+    return search(&cancel, force);
+  }
+
+  // Blocks with the same data and header fields share it, and so share their winning nonces
+  WorkKey work_key() const {
+    WorkKey key;
+    finish(header(), key.data());
+    return key;
+  }
+
+  // Takes _nonce if it satisfies the mining rule, at the cost of one hash
+  bool try_nonce(Nonce _nonce){
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    digestNonce(header(), _nonce, digest);
+    if(!meets_rule(digest, difficulty)) return false;
+    nonce = _nonce;
+    to_hex(digest, chash);
+    return true;
+  }
+
+  // sha256(index + phash + data + timestamp + difficulty + nonce) in hex
+  std::string compute_hash() const {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    digestNonce(header(), nonce, digest);
+    std::string hash(HASH_SIZE, '0');
+    to_hex(digest, hash.data());
+    return hash;
+  }
+
+  // Recomputes the hash and checks it against the stored one and the mining rule
+  bool is_valid() const {
+    return is_mined() && compute_hash().compare(0, HASH_SIZE, chash, HASH_SIZE) == 0;
+  }
+
   // Getters
 
   const auto get_chash() const {
@@ -72,6 +144,30 @@ public:
     return std::string(data, DATA_SIZE);
   }
 
+  const auto get_timestamp() const {
+    return timestamp;
+  }
+
+  const auto get_difficulty() const {
+    return difficulty;
+  }
+
+  // Whether a digest, given as a chash or as its bytes, meets the rule at _difficulty
+  static bool meets_rule(std::string_view _chash, Difficulty _difficulty){
+    std::uint64_t tail = 0;
+    const auto last = _chash.data() + HASH_SIZE;
+    if(std::from_chars(last - 16, last, tail, 16).ptr != last) return false;
+    return matches_pattern(tail, _difficulty);
+  }
+
+  static bool meets_rule(const unsigned char *digest, Difficulty _difficulty){
+    std::uint64_t tail = 0;
+    for(int i = SHA256_DIGEST_LENGTH - 8; i < SHA256_DIGEST_LENGTH; i++){
+      tail = tail << 8 | digest[i];
+    }
+    return matches_pattern(tail, _difficulty);
+  }
+
   // Setters
 
   void set_phash(auto&& _phash){
@@ -79,46 +175,142 @@ public:
   }
 
   void set_data(auto&& _data){
+    std::memset(data, 0, DATA_SIZE);
     _data.copy(data, DATA_SIZE);
   }
 
-  void update_block(auto& _nonce, auto& _phash, auto& _chash, auto& _data){
-    nonce = _nonce;
-    _phash.copy(phash, HASH_SIZE);
-    _chash.copy(chash, HASH_SIZE);
-    _data.copy(data, DATA_SIZE);
+private:
+
+  // The low level SHA256_* calls are deprecated since OpenSSL 3.0, but their
+  // context is a plain struct. Copying it per nonce costs nothing, where
+  // EVP_MD_CTX_copy_ex allocates on every copy and nearly doubles the cost
+  // of a nonce.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+  // SHA-256 state after everything but the nonce, which stays fixed during
+  // the nonce search. Timestamp and difficulty are fixed width, so no nonce
+  // can pass for a different difficulty.
+  SHA256_CTX header() const {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    char buf[24];
+    const auto end = std::to_chars(buf, buf + sizeof(buf), index).ptr;
+    SHA256_Update(&ctx, buf, end - buf);
+    SHA256_Update(&ctx, phash, HASH_SIZE);
+    SHA256_Update(&ctx, data, strnlen(data, DATA_SIZE));
+    SHA256_Update(&ctx, &timestamp, sizeof(timestamp));
+    SHA256_Update(&ctx, &difficulty, sizeof(difficulty));
+    return ctx;
   }
 
-private:
+  // Takes the header state by value, the caller's copy is left as is
+  static void digestNonce(SHA256_CTX ctx, Nonce _nonce, unsigned char *digest){
+    char buf[24];
+    const auto end = std::to_chars(buf, buf + sizeof(buf), _nonce).ptr;
+    SHA256_Update(&ctx, buf, end - buf);
+    finish(ctx, digest);
+  }
 
-  void hash_it(){
-    auto hash = sha256(std::to_string(index) + std::string(phash) + std::string(data) + std::to_string(nonce));
-    hash.copy(chash, hash.length());
+  static void finish(SHA256_CTX ctx, unsigned char *digest){
+    SHA256_Final(digest, &ctx);
   }
 
-  std::string sha256(const std::string& str) const {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, str.c_str(), str.size());
-    SHA256_Final(hash, &sha256);
-    std::stringstream ss;
-    for(int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-      ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+#pragma GCC diagnostic pop
+
+  // Nonces are tried on a copy of the header state. The rule only reads the
+  // last digest bytes, so chash is only formatted for the winner.
+  bool search(const std::atomic<bool> *cancel, bool force){
+    const auto ctx = header();
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    auto found = [&](){
+      digestNonce(ctx, nonce, digest);
+      if(!meets_rule(digest, difficulty)) return false;
+      to_hex(digest, chash);
+      return true;
+    };
+    if(force ? found() : is_mined()) return true;
+    while(true){
+      if(cancel && cancel->load(std::memory_order_relaxed)) return false;
+      nonce++;
+      if(found()) return true;
     }
-    return ss.str();
   }
 
-  bool is_mined() const {
-    auto len = HASH_SIZE;
-    if (chash[len - 1] == '4' && chash[len - 2] == '3' &&
-        chash[len - 3] == '2' && chash[len - 4] == '1') {
-      return true;
-    } else {
-      return false;
+  static bool matches_pattern(std::uint64_t tail, Difficulty _difficulty){
+    const auto mask = _difficulty >= 64 ? ~0ull : (1ull << _difficulty) - 1;
+    return ((tail ^ MINING_PATTERN) & mask) == 0;
+  }
+
+  static void to_hex(const unsigned char *digest, char *out){
+    static constexpr char hex[] = "0123456789abcdef";
+    for(int i = 0; i < SHA256_DIGEST_LENGTH; i++){
+      out[2 * i] = hex[digest[i] >> 4];
+      out[2 * i + 1] = hex[digest[i] & 0xF];
     }
   }
 
+  bool is_mined() const {
+    return meets_rule(std::string_view(chash, HASH_SIZE), difficulty);
+  }
+
+};
+
+// A block without its data, a copy of what the chain keeps in HeaderStore
+class BlockHeader {
+
+private:
+
+  Idx index;
+  Nonce nonce;
+  Timestamp timestamp;
+  Difficulty difficulty;
+  char phash[HASH_SIZE];
+  char chash[HASH_SIZE];
+
+public:
+
+  BlockHeader(const Idx _idx, const Nonce _nonce, std::string_view _phash, std::string_view _chash, Timestamp _timestamp, Difficulty _difficulty) : index(_idx), nonce(_nonce), timestamp(_timestamp), difficulty(_difficulty) {
+    _phash.copy(phash, HASH_SIZE);
+    _chash.copy(chash, HASH_SIZE);
+  }
+
+  const auto get_chash() const {
+    return std::string(chash, HASH_SIZE);
+  }
+
+  const auto get_phash() const {
+    return std::string(phash, HASH_SIZE);
+  }
+
+  const auto get_index() const {
+    return index;
+  }
+
+  const auto get_nonce() const {
+    return nonce;
+  }
+
+  const auto get_timestamp() const {
+    return timestamp;
+  }
+
+  const auto get_difficulty() const {
+    return difficulty;
+  }
+
+  std::string_view chash_view() const {
+    return std::string_view(chash, HASH_SIZE);
+  }
+
+  std::string_view phash_view() const {
+    return std::string_view(phash, HASH_SIZE);
+  }
+
+  Block with_data(const std::string& data) const {
+    return Block(index, nonce, get_phash(), get_chash(), data, timestamp, difficulty);
+  }
+
 };
 
 #endif
@@ -1,85 +1,660 @@
 #ifndef __BLOCKCHAIN_HPP_
 #define __BLOCKCHAIN_HPP_
 
-#include <list>
+#include <array>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <algorithm>
 #include <iostream>
+#include <unordered_map>
+#include <optional>
+#include <stdexcept>
 
 #include "Block.hpp"
+#include "HashIndex.hpp"
+#include "HeaderStore.hpp"
+#include "TokenIndex.hpp"
+#include "PowCache.hpp"
+#include "BodyStore.hpp"
+
+// Side blocks kept for competing branches before old ones are pruned
+static constexpr auto MAX_SIDE_BLOCKS = 1 << 16;
+// Side blocks this far below the tip can no longer win and are pruned first
+static constexpr auto SIDE_CHAIN_DEPTH = 1024;
+// Blocks between difficulty adjustments
+static constexpr Idx RETARGET_INTERVAL = 16;
+// Most bits difficulty moves by at one adjustment
+static constexpr int MAX_RETARGET_STEP = 2;
+// Target time between blocks in milliseconds. A consensus rule, so a chain
+// constant rather than a node setting: nodes disagreeing on it would reject
+// each other's blocks for good.
+static constexpr Timestamp BLOCK_INTERVAL = 100;
+// How far past this node's clock a peer's block may be stamped, in milliseconds
+static constexpr Timestamp MAX_CLOCK_DRIFT = 2 * 60 * 1000;
 
 class BlockChain {
 
 private:
 
-  std::list<Block> chain;
+  // Headers of every main chain block, their data lives in bodies
+  HeaderStore headers;
+  BodyStore bodies;
+  HashIndex chash_index;
+  // Words of every main chain body, kept in step with bodies
+  TokenIndex tokens;
+  PowCache pow_cache;
+
+  // Blocks of competing branches, keyed by chash. Together with the main chain
+  // they form a block tree, each branch hangs off its parent through phash.
+  struct SideBlock {
+    Block block;
+    // Total work of the chain the block ends, 0 while its parent is not known
+    Idx work = 0;
+  };
+  std::unordered_map<std::string, SideBlock> side_blocks;
+  // Side block chashes by phash, so a block that arrives after its children
+  // brings them in with it
+  std::unordered_multimap<std::string, std::string> side_children;
+
+  // Point-in-time view for a snapshot export: the chain length when it began
+  // and the pre-images of blocks below it that have changed since
+  struct SnapshotView {
+    Idx length;
+    std::unordered_map<Idx, Block> preimages;
+  };
+  std::optional<SnapshotView> snapshot_view;
+
+  // prefix_digests[i] chains the chash of block i onto prefix_digests[i - 1].
+  // Filled lazily by readers, so it has its own lock; entries from
+  // digests_valid on are stale.
+  mutable std::mutex digest_mutex;
+  mutable std::vector<std::array<unsigned char, DIGEST_SIZE>> prefix_digests;
+  mutable Idx digests_valid = 0;
+
+  // Timestamp and difficulty of block i, from pending where it covers i and
+  // from the main chain below it
+  auto stampsWith(const std::vector<Block>& pending) const {
+    return [this, &pending](Idx i){
+      const auto base = pending.empty() ? headers.size() : pending.front().get_index();
+      if(i >= base && i - base < pending.size()){
+        return std::pair{pending[i - base].get_timestamp(), pending[i - base].get_difficulty()};
+      }
+      // Past the tip only for stale pending blocks, which fail their link check
+      i = std::min<Idx>(i, headers.size() - 1);
+      return std::pair{headers.timestamp(i), headers.difficulty(i)};
+    };
+  }
+
+  // Timestamp and difficulty of ancestor i of a block whose parent is phash,
+  // through side blocks down to the main chain
+  auto sideStamps(const std::string& phash) const {
+    return [this, phash](Idx i){
+      auto hash = phash;
+      for(auto s_it = side_blocks.find(hash); s_it != side_blocks.end(); s_it = side_blocks.find(hash)){
+        const auto& block = s_it->second.block;
+        if(block.get_index() == i){
+          return std::pair{block.get_timestamp(), block.get_difficulty()};
+        }
+        hash = block.get_phash();
+      }
+      i = std::min<Idx>(i, headers.size() - 1);
+      return std::pair{headers.timestamp(i), headers.difficulty(i)};
+    };
+  }
 
 public:
 
   BlockChain(){
-    chain.emplace_back(0, "1234", "The Genisys Block");
-    chain.back().mine_block();
+    push(Block(0, "1234", "The Genisys Block"));
   }
 
   void addData(const std::string& data){
-    chain.emplace_back(chain.size(), chain.back().get_chash(), data);
-    chain.back().mine_block();
+    auto block = nextBlock(data);
+    mine(block);
+    push(block);
+  }
+
+  // Keeps only the bodies within limits in memory, spilling the rest to path
+  void setPruning(BodyStore::Limits limits, const std::string& path = std::string()){
+    bodies.setLimits(limits, path);
+  }
+
+  const BodyStore& getBodies() const {
+    return bodies;
+  }
+
+  void bindMetrics(Metrics& metrics){
+    bodies.bindMetrics(metrics);
+    pow_cache.bindMetrics(metrics);
+  }
+
+  // Unmined block extending the current tip, to be mined outside the chain lock
+  Block nextBlock(const std::string& data) const {
+    return nextBlock(std::vector<Block>(), data);
   }
 
-  void updateBlock(auto _idx, auto _nonce, const auto& _phash, const auto& _chash, const auto& _data){
-    if(_idx == chain.size()){
-      chain.emplace_back(_idx, _nonce, _phash, _chash, _data);
+  // Unmined block extending pending, blocks mined on top of the tip that are
+  // not appended yet. Stamped now, at the difficulty the schedule expects.
+  Block nextBlock(const std::vector<Block>& pending, const std::string& data) const {
+    const auto stamps = stampsWith(pending);
+    const auto idx = pending.empty() ? headers.size() : pending.back().get_index() + 1;
+    const auto phash = pending.empty() ? tipChash() : pending.back().get_chash();
+    // A clock behind the parent's stamp must not make the block invalid
+    const auto timestamp = std::max(currentTime(), stamps(idx - 1).first);
+    return Block(idx, 0, phash, std::string(), data, timestamp, expectedDifficulty(idx, stamps));
+  }
+
+  // Appends a mined block, fails if the tip moved while it was mined
+  bool appendBlock(const Block& block){
+    if(block.get_index() != headers.size() || block.get_phash() != headers.chash(headers.size() - 1) || !followsSchedule(block, stampsWith({}))){
+      return false;
+    }
+    push(block);
+    return true;
+  }
+
+  // Appends mined blocks that extend the tip and each other, all or none
+  bool appendBlocks(const std::vector<Block>& blocks){
+    auto prev_idx = headers.size() - 1;
+    auto prev_chash = tipChash();
+    for(const auto& block : blocks){
+      if(block.get_index() != prev_idx + 1 || block.get_phash() != prev_chash || !followsSchedule(block, stampsWith(blocks))){
+        return false;
+      }
+      prev_idx = block.get_index();
+      prev_chash = block.get_chash();
+    }
+    for(const auto& block : blocks){
+      push(block);
+    }
+    return true;
+  }
+
+  // Adds a peer's block to the block tree. It is appended if it extends the
+  // tip, otherwise stored as a side block and the heavier branch becomes the
+  // main chain. Returns the lowest main chain index that changed, if any.
+  std::optional<Idx> updateBlock(auto _idx, auto _nonce, const auto& _phash, const auto& _chash, const auto& _data, Timestamp _timestamp, Difficulty _difficulty){
+    Block block(_idx, _nonce, _phash, _chash, _data, _timestamp, _difficulty);
+    if(!isPlausible(block)){
+      err("rejected invalid block " << _idx);
+      return std::nullopt;
+    }
+    // A peer's block may be one this node has to re-mine later, e.g. after a revert
+    pow_cache.insert(block.work_key(), block.get_nonce());
+    const auto chash = block.get_chash();
+    if(findChash(chash) || side_blocks.count(chash)){
+      return std::nullopt;
+    }
+    if(block.get_index() == headers.size() && block.get_phash() == headers.chash(headers.size() - 1)){
+      if(!followsSchedule(block, stampsWith({}))){
+        return std::nullopt;
+      }
+      push(block);
+      // Its children may have come first, in which case they now win
+      selectBestChain(connectDescendants(chash, block.get_index(), headers.work(block.get_index())));
+      return block.get_index();
+    }
+    if(block.get_index() == 0){
+      return std::nullopt;
     }
-    else if(_idx < chain.size()){
-      auto c_it = chain.begin();
-      std::advance(c_it, _idx);
-      c_it->update_block(_nonce, _phash, _chash, _data);
+    storeSideBlock(block, 0);
+    const auto parent_work = parentWork(block);
+    if(!parent_work){
+      return std::nullopt; // parent not known yet
     }
+    if(!followsSchedule(block, sideStamps(block.get_phash()))){
+      eraseSideBlock(chash);
+      return std::nullopt;
+    }
+    const auto work = *parent_work + blockWork(block);
+    side_blocks.at(chash).work = work;
+    return selectBestChain(connectDescendants(chash, block.get_index(), work));
+  }
+
+  // True for blocks on the main chain and on side branches
+  bool contains(const std::string& chash) const {
+    return side_blocks.count(chash) || findChash(chash);
+  }
+
+  auto getSideLength() const {
+    return side_blocks.size();
   }
 
-  void updateData(auto _idx, const auto& _data){
-    auto c_it = chain.begin();
-    std::advance(c_it, _idx);
-    c_it->set_data(_data);
-    c_it->mine_block(true);
+  // Returns the number of hashes tried to re-mine the block
+  Nonce updateData(auto _idx, const auto& _data){
+    preserve(_idx);
+    auto block = blockAt(_idx);
+    block.set_data(_data);
+    const auto hashes = mine(block);
+    replace(block);
+    return hashes;
   }
 
   auto getLength() const {
-    return chain.size();
+    return headers.size();
   }
 
+  // Re-mines every block whose phash no longer matches the chash before it
   void repairChain(){
-    auto f_it = chain.begin();
-    auto s_it = ++chain.begin();
-    while(s_it != chain.end()){
-      if(s_it->get_phash() != f_it->get_chash()){
-        s_it->set_phash(f_it->get_chash());
-        s_it->mine_block();
+    for(auto idx = headers.findBrokenLink(1, headers.size()); idx < headers.size(); idx = headers.findBrokenLink(idx + 1, headers.size())){
+      preserve(idx);
+      auto block = blockAt(idx);
+      block.set_phash(headers.chash(idx - 1));
+      mine(block);
+      replace(block);
+    }
+  }
+
+  // Expected hashes to mine the block, so the branch that cost the most to
+  // build wins rather than the longest one
+  static constexpr Idx blockWork(const auto& block){
+    return difficultyWork(block.get_difficulty());
+  }
+
+  // Difficulty block idx must carry, given the timestamp and difficulty of
+  // each ancestor through stamps(i). Every RETARGET_INTERVAL blocks it moves
+  // by one bit, halving or doubling the expected hashes, for each doubling
+  // by which the last interval missed BLOCK_INTERVAL.
+  Difficulty expectedDifficulty(Idx idx, auto&& stamps) const {
+    const auto [last, parent] = stamps(idx - 1);
+    if(idx % RETARGET_INTERVAL != 0){
+      return parent;
+    }
+    // The genesis stamp is not a real time
+    const auto first = std::max<Idx>(idx - RETARGET_INTERVAL, 1);
+    const auto since = stamps(first).first;
+    const Timestamp actual = last > since ? last - since : 1;
+    const Timestamp expected = BLOCK_INTERVAL * (idx - 1 - first);
+    int step = 0;
+    if(actual < expected){
+      while(step < MAX_RETARGET_STEP && actual << (step + 1) <= expected) step++;
+    }
+    else{
+      while(-step < MAX_RETARGET_STEP && expected << (1 - step) <= actual) step--;
+    }
+    return std::clamp<int>(int(parent) + step, MIN_DIFFICULTY, MAX_DIFFICULTY);
+  }
+
+  // Digest of the chashes of blocks [0, length). Two chains agree on it
+  // exactly when they agree on every block below length, so it is cached
+  // and only the changed suffix is rehashed.
+  std::string prefixDigest(Idx length) const {
+    std::scoped_lock digest_lock(digest_mutex);
+    length = std::min<Idx>(length, headers.size());
+    if(prefix_digests.size() < length){
+      prefix_digests.resize(length);
+    }
+    for(; digests_valid < length; digests_valid++){
+      unsigned char link[DIGEST_SIZE + HASH_SIZE] = {0};
+      if(digests_valid > 0){
+        std::memcpy(link, prefix_digests[digests_valid - 1].data(), DIGEST_SIZE);
       }
-      ++f_it; ++s_it;
+      headers.chash(digests_valid).copy(reinterpret_cast<char*>(link) + DIGEST_SIZE, HASH_SIZE);
+      SHA256(link, sizeof(link), prefix_digests[digests_valid].data());
     }
+    if(length == 0){
+      return std::string(DIGEST_SIZE, '\0');
+    }
+    return std::string(reinterpret_cast<const char*>(prefix_digests[length - 1].data()), DIGEST_SIZE);
   }
 
   auto getChash(auto index) const {
-    auto c_it = chain.begin();
-    std::advance(c_it, index);
-    return c_it->get_chash();
+    return std::string(headers.chash(index));
+  }
+
+  // Index of the block with this chash, one probe into chash_index
+  std::optional<Idx> findChash(const std::string& chash) const {
+    return chash_index.find(chash, [this, &chash](Idx idx){
+      return idx < headers.size() && headers.chash(idx) == chash;
+    });
   }
 
   auto getBlock(auto index) const {
-    auto c_it = chain.begin();
-    std::advance(c_it, index);
-    return std::tuple{c_it->get_nonce(), c_it->get_phash(), c_it->get_chash(), c_it->get_data()};
+    return std::tuple{headers.nonce(index), std::string(headers.phash(index)), std::string(headers.chash(index)), blockAt(index).get_data()};
+  }
+
+  // Header and body handle of a main chain block, copies neither hashes nor data
+  std::pair<BlockHeader, BodyRef> getBlockRef(Idx idx) const {
+    return {headers.header(idx), bodies.get(idx)};
+  }
+
+  // Header and body digest of a main chain block, for peers that may hold the body already
+  std::pair<BlockHeader, BodyDigest> getHeader(Idx idx) const {
+    return {headers.header(idx), bodies.digest(idx)};
+  }
+
+  // Data of any main chain block whose body has this digest, nullptr if none
+  BodyRef findBody(const BodyDigest& digest) const {
+    return bodies.find(digest);
+  }
+
+  // Main chain blocks whose data holds every token of query, see TokenIndex::find
+  std::vector<Idx> findData(std::string_view query, std::size_t limit) const {
+    return tokens.find(query, limit);
+  }
+
+  // Checks PoW, phash links and the difficulty schedule of blocks [from, to);
+  // safe to run concurrently on disjoint ranges
+  bool verifyRange(Idx from, Idx to) const {
+    to = std::min<Idx>(to, headers.size());
+    if(const auto broken = headers.findBrokenLink(from, to); broken < to){
+      err("block " << broken << " does not link to block " << broken - 1);
+      return false;
+    }
+    for(auto idx = from; idx < to; idx++){
+      if(!followsSchedule(headers.header(idx), stampsWith({}))){
+        return false;
+      }
+      if(!blockAt(idx).is_valid()){
+        err("block " << idx << " has an invalid hash");
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Starts a point-in-time view, returns its length. Blocks below it read
+  // through snapshotBlock keep their value at this moment until endSnapshot.
+  Idx beginSnapshot(){
+    snapshot_view = SnapshotView{headers.size(), {}};
+    return headers.size();
+  }
+
+  Block snapshotBlock(Idx idx) const {
+    const auto p_it = snapshot_view->preimages.find(idx);
+    return p_it != snapshot_view->preimages.end() ? p_it->second : blockAt(idx);
+  }
+
+  void endSnapshot(){
+    snapshot_view.reset();
+  }
+
+  // Progress of a chain read in order from genesis, see importBlocks
+  struct ChainImport {
+    Idx next = 0;
+    std::string tip;
+    // Total work of the blocks read so far
+    Idx work = 0;
+    // Blocks read since the chain left the main chain, until they outweigh it
+    std::vector<Block> staged;
+  };
+
+  // Takes the next consecutive blocks of a chain read from genesis on, so a
+  // long chain is checked and applied a run at a time. Blocks extend the
+  // main chain while it agrees with the chain read, a competing suffix is
+  // held in import.staged until it carries more work than the main chain.
+  // Throws std::runtime_error on an invalid block. Returns the lowest
+  // changed index, if any.
+  std::optional<Idx> importBlocks(ChainImport& import, const std::vector<Block>& blocks){
+    std::optional<Idx> changed;
+    for(const auto& block : blocks){
+      const auto idx = block.get_index();
+      const auto chash = block.get_chash();
+      if(idx != import.next || (idx == 0 ? chash != headers.chash(0) : block.get_phash() != import.tip)){
+        throw std::runtime_error("block " + std::to_string(idx) + " does not extend the chain read");
+      }
+      import.next++;
+      import.tip = chash;
+      import.work += blockWork(block);
+      if(idx == 0 || (import.staged.empty() && idx < headers.size() && headers.chash(idx) == chash)){
+        continue;
+      }
+      if(!isPlausible(block) || !followsSchedule(block, stampsWith(import.staged))){
+        throw std::runtime_error("block " + std::to_string(idx) + " is invalid");
+      }
+      if(import.staged.empty() && idx == headers.size()){
+        push(block);
+        changed = std::min(changed.value_or(idx), idx);
+        continue;
+      }
+      import.staged.push_back(block);
+      if(import.work <= headers.work(headers.size() - 1)){
+        continue;
+      }
+      const auto first = import.staged.front().get_index();
+      if(first > headers.size() || import.staged.front().get_phash() != headers.chash(first - 1)){
+        throw std::runtime_error("chain changed under the import at block " + std::to_string(first));
+      }
+      displace(first);
+      for(const auto& staged : import.staged){
+        push(staged);
+      }
+      import.staged.clear();
+      changed = std::min(changed.value_or(first), first);
+    }
+    return changed;
   }
 
   void printChain() const {
-    for(const auto& b : chain){
+    for(Idx idx = 0; idx < headers.size(); idx++){
+      const auto b = blockAt(idx);
       std::cout<<"========== Block " << b.get_index() << " ==========" << std::endl;
-      std::cout<<"P-hash : "<<b.get_phash()<<std::endl;
+      std::cout<<"P-hash : "<<b.get_phash().c_str()<<std::endl;
       std::cout<<"C-hash : "<<b.get_chash()<<std::endl;
-      std::cout<<"Data : "<<b.get_data()<<std::endl;
+      std::cout<<"Time : "<<b.get_timestamp()<<std::endl;
+      std::cout<<"Difficulty : "<<b.get_difficulty()<<std::endl;
+      std::cout<<"Data : "<<b.get_data().c_str()<<std::endl;
       std::cout<<std::endl;
     }
   }
 
+private:
+
+  // Re-mines block, starting with the nonce last found for the same prefix.
+  // Returns the number of hashes tried.
+  Nonce mine(Block& block){
+    const auto key = block.work_key();
+    if(const auto nonce = pow_cache.find(key); nonce && block.try_nonce(*nonce)){
+      return 1;
+    }
+    const auto from = block.get_nonce();
+    block.mine_block(true);
+    pow_cache.insert(key, block.get_nonce());
+    return block.get_nonce() - from + 1;
+  }
+
+  // Checks a block's timestamp and difficulty against its ancestors, see expectedDifficulty
+  bool followsSchedule(const auto& block, auto&& stamps) const {
+    const auto idx = block.get_index();
+    if(idx == 0){
+      return true;
+    }
+    if(block.get_timestamp() < stamps(idx - 1).first){
+      err("block " << idx << " is stamped before its parent");
+      return false;
+    }
+    if(block.get_difficulty() != expectedDifficulty(idx, stamps)){
+      err("block " << idx << " has difficulty " << block.get_difficulty() << ", expected " << expectedDifficulty(idx, stamps));
+      return false;
+    }
+    return true;
+  }
+
+  // What can be checked of a peer's block without its ancestors
+  static bool isPlausible(const Block& block){
+    return block.is_valid() && block.get_difficulty() >= MIN_DIFFICULTY && block.get_timestamp() <= currentTime() + MAX_CLOCK_DRIFT;
+  }
+
+  Block blockAt(Idx idx) const {
+    return headers.header(idx).with_data(*bodies.get(idx));
+  }
+
+  std::string tipChash() const {
+    return std::string(headers.chash(headers.size() - 1));
+  }
+
+  void push(const Block& block){
+    headers.push(block);
+    bodies.put(block.get_index(), block.get_data());
+    tokens.insert(block.get_index(), block.get_data());
+    chash_index.insert(block.get_chash(), block.get_index());
+  }
+
+  // Swaps in a changed version of a main chain block
+  void replace(const Block& block){
+    const auto idx = block.get_index();
+    // Reverting the change re-mines this version, so remember its nonce
+    const auto old = blockAt(idx);
+    pow_cache.insert(old.work_key(), old.get_nonce());
+    chash_index.erase(std::string(headers.chash(idx)), idx);
+    invalidateDigests(idx);
+    headers.set(idx, block);
+    tokens.erase(idx, old.get_data());
+    tokens.insert(idx, block.get_data());
+    bodies.put(idx, block.get_data());
+    chash_index.insert(block.get_chash(), idx);
+  }
+
+  // Moves blocks [from, end) from the main chain to the side blocks
+  void displace(Idx from){
+    preserve(from, headers.size());
+    std::vector<SideBlock> removed;
+    for(auto idx = from; idx < headers.size(); idx++){
+      removed.push_back(SideBlock{blockAt(idx), headers.work(idx)});
+      tokens.erase(idx, removed.back().block.get_data());
+      chash_index.erase(std::string(headers.chash(idx)), idx);
+    }
+    headers.truncate(from);
+    bodies.truncate(from);
+    invalidateDigests(from);
+    for(const auto& side : removed){
+      storeSideBlock(side.block, side.work);
+    }
+  }
+
+  void invalidateDigests(Idx from){
+    std::scoped_lock digest_lock(digest_mutex);
+    digests_valid = std::min(digests_valid, from);
+  }
+
+  // Saves the current value of blocks [from, to) before they change under a snapshot view
+  void preserve(Idx from, Idx to){
+    if(!snapshot_view) return;
+    for(auto idx = from; idx < to && idx < snapshot_view->length; idx++){
+      if(!snapshot_view->preimages.count(idx)){
+        snapshot_view->preimages.emplace(idx, blockAt(idx));
+      }
+    }
+  }
+
+  void preserve(Idx idx){
+    preserve(idx, idx + 1);
+  }
+
+  void storeSideBlock(const Block& block, Idx work){
+    if(side_blocks.size() >= MAX_SIDE_BLOCKS){
+      for(auto s_it = side_blocks.begin(); s_it != side_blocks.end();){
+        const auto& side = (s_it++)->second;
+        if(side.block.get_index() + SIDE_CHAIN_DEPTH < headers.size()){
+          eraseSideBlock(side.block.get_chash());
+        }
+      }
+      if(side_blocks.size() >= MAX_SIDE_BLOCKS){
+        side_blocks.clear();
+        side_children.clear();
+      }
+    }
+    if(side_blocks.emplace(block.get_chash(), SideBlock{block, work}).second){
+      side_children.emplace(block.get_phash(), block.get_chash());
+    }
+  }
+
+  void eraseSideBlock(const std::string& chash){
+    const auto s_it = side_blocks.find(chash);
+    if(s_it == side_blocks.end()) return;
+    const auto [c_begin, c_end] = side_children.equal_range(s_it->second.block.get_phash());
+    for(auto c_it = c_begin; c_it != c_end; ++c_it){
+      if(c_it->second == chash){
+        side_children.erase(c_it);
+        break;
+      }
+    }
+    side_blocks.erase(s_it);
+  }
+
+  // Total work of the chain ending at block's parent, if that parent is on
+  // the main chain or a side block whose own parent is known
+  std::optional<Idx> parentWork(const Block& block) const {
+    const auto phash = block.get_phash();
+    if(const auto idx = findChash(phash); idx && *idx + 1 == block.get_index()){
+      return headers.work(*idx);
+    }
+    if(const auto s_it = side_blocks.find(phash); s_it != side_blocks.end() && s_it->second.work && s_it->second.block.get_index() + 1 == block.get_index()){
+      return s_it->second.work;
+    }
+    return std::nullopt;
+  }
+
+  // Whether tip a loses to tip b: it carries less work, or equal work and
+  // the higher chash, so every node picks the same one
+  static bool lighter(const std::pair<Idx, std::string>& a, const std::pair<Idx, std::string>& b){
+    return a.first != b.first ? a.first < b.first : a.second > b.second;
+  }
+
+  // Connects the side blocks waiting on hash, a block at idx that carries
+  // work, and their descendants in turn. Each side block is connected once.
+  // Returns the heaviest tip reached and its work, hash itself if none.
+  std::pair<Idx, std::string> connectDescendants(const std::string& hash, Idx idx, Idx work){
+    std::pair best{work, hash};
+    std::vector<std::tuple<std::string, Idx, Idx>> pending{{hash, idx, work}};
+    while(!pending.empty()){
+      const auto [parent, parent_idx, parent_work] = std::move(pending.back());
+      pending.pop_back();
+      std::vector<std::string> children;
+      const auto [c_begin, c_end] = side_children.equal_range(parent);
+      for(auto c_it = c_begin; c_it != c_end; ++c_it){
+        children.push_back(c_it->second);
+      }
+      for(const auto& child : children){
+        auto& side = side_blocks.at(child);
+        if(side.work){
+          continue;
+        }
+        if(side.block.get_index() != parent_idx + 1 || !followsSchedule(side.block, sideStamps(parent))){
+          eraseSideBlock(child);
+          continue;
+        }
+        side.work = parent_work + blockWork(side.block);
+        best = std::max(best, std::pair{side.work, child}, lighter);
+        pending.emplace_back(child, parent_idx + 1, side.work);
+      }
+    }
+    return best;
+  }
+
+  // Makes the side branch ending at tip the main chain if it carries more
+  // work than the main chain. Returns the lowest changed index.
+  std::optional<Idx> selectBestChain(const std::pair<Idx, std::string>& tip){
+    if(!side_blocks.count(tip.second) || !lighter({headers.work(headers.size() - 1), tipChash()}, tip)){
+      return std::nullopt;
+    }
+    std::vector<std::string> branch;
+    auto hash = tip.second;
+    for(auto s_it = side_blocks.find(hash); s_it != side_blocks.end(); s_it = side_blocks.find(hash)){
+      branch.push_back(hash);
+      hash = s_it->second.block.get_phash();
+    }
+    const auto fork = findChash(hash);
+    const auto first = side_blocks.at(branch.back()).block.get_index();
+    if(!fork || *fork + 1 != first){
+      return std::nullopt; // its fork point was replaced since
+    }
+
+    imsg("reorg at " << first << " : " << headers.size() - first << " blocks replaced by " << branch.size());
+    // Taken out before displace() stores the old blocks, which may evict side blocks
+    std::vector<Block> blocks;
+    for(auto b_it = branch.rbegin(); b_it != branch.rend(); ++b_it){
+      blocks.push_back(side_blocks.at(*b_it).block);
+      eraseSideBlock(*b_it);
+    }
+    displace(first);
+    for(const auto& block : blocks){
+      push(block);
+    }
+    return first;
+  }
+
 };
 
 #endif
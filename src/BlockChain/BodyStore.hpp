@@ -0,0 +1,415 @@
+#ifndef __BODY_STORE_HPP__
+#define __BODY_STORE_HPP__
+
+#include <list>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#include "../Metrics.hpp"
+
+using Idx = unsigned long long int;
+
+// Consecutive blocks land on different shards
+static constexpr auto BODY_SHARDS = 16;
+
+// Shared, immutable block data. Copying a handle does not copy or allocate
+// and it stays valid after the body is evicted or replaced.
+using BodyRef = std::shared_ptr<const std::string>;
+
+// SHA-256 of a body as stored, without its NUL padding
+using BodyDigest = std::array<unsigned char, SHA256_DIGEST_LENGTH>;
+
+inline BodyDigest bodyDigest(std::string_view body){
+  BodyDigest digest;
+  SHA256(reinterpret_cast<const unsigned char*>(body.data()), body.size(), digest.data());
+  return digest;
+}
+
+// The digest is uniform already, its first word is a good hash
+struct BodyDigestHash {
+  std::size_t operator()(const BodyDigest& digest) const {
+    std::size_t h;
+    std::memcpy(&h, digest.data(), sizeof(h));
+    return h;
+  }
+};
+
+// Block data by index, a sharded LRU cache in front of a spill file. Without
+// limits every body stays in memory. With limits, which hold for the store as
+// a whole, each shard's least recently used bodies are spilled to the file
+// and read back on demand, so memory no longer grows with the chain.
+// Bodies are content addressed: blocks with the same data share one copy in
+// memory and one in the file.
+class BodyStore {
+
+  struct Entry {
+    BodyRef body;
+    std::list<Idx>::iterator lru;
+  };
+
+  // Where a body lives in the spill file
+  struct Spilled {
+    std::uint64_t offset = 0;
+    std::uint32_t size = 0;
+    bool valid = false;
+  };
+
+  // One per distinct body. refs counts the blocks holding it, the data stays
+  // in memory while one of them is resident or a handle is held elsewhere.
+  // loading is set while a reader has it in flight from the spill file.
+  struct Blob {
+    std::size_t refs = 0;
+    std::weak_ptr<const std::string> body;
+    Spilled spilled;
+    bool loading = false;
+  };
+
+  struct Slot {
+    BodyDigest digest;
+    bool valid = false;
+  };
+
+  struct alignas(CACHE_LINE) Shard {
+    std::mutex mutex;
+    std::unordered_map<Idx, Entry> resident;
+    std::list<Idx> lru;
+    // Indexed by idx / BODY_SHARDS
+    std::vector<Slot> slots;
+  };
+
+public:
+
+  // 0 means no limit
+  struct Limits {
+    Idx max_blocks = 0;
+    std::size_t max_bytes = 0;
+  };
+
+private:
+
+  // Readers of the chain share bchain_mutex, so lookups lock their shard
+  mutable std::array<Shard, BODY_SHARDS> shards;
+
+  // Taken after a shard's mutex, never before it
+  mutable std::mutex blob_mutex;
+  mutable std::unordered_map<BodyDigest, Blob, BodyDigestHash> blobs;
+  // Signalled on blob_mutex when a load finishes
+  mutable std::condition_variable loaded_cv;
+
+  Limits limits;
+  std::FILE *file = nullptr;
+  mutable std::atomic<std::uint64_t> file_end{0};
+
+  mutable std::atomic<std::int64_t> resident_bytes{0};
+  mutable std::atomic<std::int64_t> resident_blocks{0};
+  Counter *hits = nullptr;
+  Counter *misses = nullptr;
+  Counter *dedup_hits = nullptr;
+  Gauge *bytes_gauge = nullptr;
+  Gauge *blobs_gauge = nullptr;
+
+public:
+
+  BodyStore() = default;
+  BodyStore(const BodyStore&) = delete;
+  BodyStore& operator=(const BodyStore&) = delete;
+
+  ~BodyStore(){
+    if(file) std::fclose(file);
+  }
+
+  // Spills to path, or to an anonymous temporary file if path is empty.
+  // The file only backs this process, it is truncated on open.
+  void setLimits(Limits _limits, const std::string& path = std::string()){
+    limits = _limits;
+    if(!limits.max_blocks && !limits.max_bytes) return;
+    if(!file){
+      file = path.empty() ? std::tmpfile() : std::fopen(path.c_str(), "w+b");
+      if(!file){
+        throw std::runtime_error("cannot open body store " + path + " : " + std::strerror(errno));
+      }
+    }
+    for(auto& shard : shards){
+      std::scoped_lock shard_lock(shard.mutex);
+      evict(shard);
+    }
+  }
+
+  // Cache hits and misses, the bytes held in memory, and how many bodies
+  // were already stored for another block
+  void bindMetrics(Metrics& metrics){
+    hits = &metrics.counter("body_cache_hits");
+    misses = &metrics.counter("body_cache_misses");
+    dedup_hits = &metrics.counter("body_dedup_hits");
+    bytes_gauge = &metrics.gauge("body_cache_bytes");
+    blobs_gauge = &metrics.gauge("body_blobs");
+  }
+
+  // Stores data, trimmed of its NUL padding, as the body of block idx
+  void put(Idx idx, const std::string& data){
+    const auto trimmed = std::string_view(data).substr(0, data.find('\0'));
+    const auto digest = bodyDigest(trimmed);
+    auto& shard = shardOf(idx);
+    std::scoped_lock shard_lock(shard.mutex);
+    const auto slot = idx / BODY_SHARDS;
+    if(slot >= shard.slots.size()) shard.slots.resize(slot + 1);
+    auto body = acquire(digest, trimmed);
+    if(shard.slots[slot].valid) release(shard.slots[slot].digest);
+    shard.slots[slot] = Slot{digest, true};
+    auto [r_it, inserted] = shard.resident.try_emplace(idx);
+    if(inserted){
+      shard.lru.push_front(idx);
+      r_it->second.lru = shard.lru.begin();
+    }
+    else{
+      account(-std::int64_t(r_it->second.body->size()), -1);
+      shard.lru.splice(shard.lru.begin(), shard.lru, r_it->second.lru);
+    }
+    account(body->size(), 1);
+    r_it->second.body = std::move(body);
+    evict(shard);
+  }
+
+  // A spilled body is read back with no lock held, the shard and the other
+  // bodies stay available meanwhile
+  BodyRef get(Idx idx) const {
+    auto& shard = shardOf(idx);
+    std::unique_lock shard_lock(shard.mutex);
+    if(const auto r_it = shard.resident.find(idx); r_it != shard.resident.end()){
+      if(hits) hits->add();
+      shard.lru.splice(shard.lru.begin(), shard.lru, r_it->second.lru);
+      return r_it->second.body;
+    }
+    if(misses) misses->add();
+    const auto slot = idx / BODY_SHARDS;
+    if(slot >= shard.slots.size() || !shard.slots[slot].valid){
+      throw std::out_of_range("no body for block " + std::to_string(idx));
+    }
+    const auto digest = shard.slots[slot].digest;
+    shard_lock.unlock();
+
+    std::unique_lock blob_lock(blob_mutex);
+    auto body = load(digest, blob_lock);
+    blob_lock.unlock();
+    if(!body) throw std::out_of_range("no body for block " + std::to_string(idx));
+
+    // The block may have been cached or replaced while the shard was unlocked
+    shard_lock.lock();
+    if(const auto r_it = shard.resident.find(idx); r_it != shard.resident.end()) return r_it->second.body;
+    if(slot >= shard.slots.size() || !shard.slots[slot].valid || shard.slots[slot].digest != digest) return body;
+    shard.lru.push_front(idx);
+    shard.resident.emplace(idx, Entry{body, shard.lru.begin()});
+    account(body->size(), 1);
+    evict(shard);
+    return body;
+  }
+
+  // The body with this digest if any block holds it, nullptr otherwise
+  BodyRef find(const BodyDigest& digest) const {
+    std::unique_lock blob_lock(blob_mutex);
+    return load(digest, blob_lock);
+  }
+
+  BodyDigest digest(Idx idx) const {
+    auto& shard = shardOf(idx);
+    std::scoped_lock shard_lock(shard.mutex);
+    const auto slot = idx / BODY_SHARDS;
+    if(slot >= shard.slots.size() || !shard.slots[slot].valid){
+      throw std::out_of_range("no body for block " + std::to_string(idx));
+    }
+    return shard.slots[slot].digest;
+  }
+
+  // Drops the bodies of blocks from length on
+  void truncate(Idx length){
+    for(std::size_t s = 0; s < BODY_SHARDS; s++){
+      auto& shard = shards[s];
+      std::scoped_lock shard_lock(shard.mutex);
+      for(auto l_it = shard.lru.begin(); l_it != shard.lru.end();){
+        if(*l_it >= length){
+          const auto r_it = shard.resident.find(*l_it);
+          account(-std::int64_t(r_it->second.body->size()), -1);
+          shard.resident.erase(r_it);
+          l_it = shard.lru.erase(l_it);
+        }
+        else{
+          ++l_it;
+        }
+      }
+      // First slot of this shard at or past length
+      const auto keep = length / BODY_SHARDS + (length % BODY_SHARDS > s);
+      for(auto slot = keep; slot < shard.slots.size(); slot++){
+        if(shard.slots[slot].valid) release(shard.slots[slot].digest);
+      }
+      if(keep < shard.slots.size()) shard.slots.resize(keep);
+    }
+  }
+
+  std::size_t residentCount() const {
+    std::size_t count = 0;
+    for(auto& shard : shards){
+      std::scoped_lock shard_lock(shard.mutex);
+      count += shard.resident.size();
+    }
+    return count;
+  }
+
+  std::size_t residentBytes() const {
+    return resident_bytes.load(std::memory_order_relaxed);
+  }
+
+  std::size_t blobCount() const {
+    std::scoped_lock blob_lock(blob_mutex);
+    return blobs.size();
+  }
+
+private:
+
+  Shard& shardOf(Idx idx) const {
+    return shards[idx % BODY_SHARDS];
+  }
+
+  void account(std::int64_t bytes, std::int64_t blocks) const {
+    const auto total = resident_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    resident_blocks.fetch_add(blocks, std::memory_order_relaxed);
+    if(bytes_gauge) bytes_gauge->set(total);
+  }
+
+  bool overLimits() const {
+    return (limits.max_blocks && resident_blocks.load(std::memory_order_relaxed) > std::int64_t(limits.max_blocks)) || (limits.max_bytes && resident_bytes.load(std::memory_order_relaxed) > std::int64_t(limits.max_bytes));
+  }
+
+  // Takes a reference to the blob of digest, storing body if it is new
+  BodyRef acquire(const BodyDigest& digest, std::string_view body){
+    std::scoped_lock blob_lock(blob_mutex);
+    auto [b_it, created] = blobs.try_emplace(digest);
+    auto& blob = b_it->second;
+    blob.refs++;
+    if(created){
+      if(blobs_gauge) blobs_gauge->set(blobs.size());
+    }
+    else{
+      if(dedup_hits) dedup_hits->add();
+      // A spilled copy is not read back, body holds the same data
+      if(auto stored = blob.body.lock()) return stored;
+    }
+    auto stored = std::make_shared<const std::string>(body);
+    blob.body = stored;
+    return stored;
+  }
+
+  void release(const BodyDigest& digest){
+    std::scoped_lock blob_lock(blob_mutex);
+    const auto b_it = blobs.find(digest);
+    if(b_it == blobs.end() || --b_it->second.refs > 0) return;
+    blobs.erase(b_it);
+    if(blobs_gauge) blobs_gauge->set(blobs.size());
+  }
+
+  // The body of a blob, from memory or the spill file, nullptr if no block
+  // holds it. blob_lock holds blob_mutex and is released around the read.
+  // A reader finding the blob already loading waits for that load instead.
+  BodyRef load(const BodyDigest& digest, std::unique_lock<std::mutex>& blob_lock) const {
+    while(true){
+      const auto b_it = blobs.find(digest);
+      if(b_it == blobs.end()) return nullptr;
+      auto& blob = b_it->second;
+      if(auto body = blob.body.lock()) return body;
+      if(!blob.spilled.valid) return nullptr;
+      if(blob.loading){
+        loaded_cv.wait(blob_lock);
+        continue;
+      }
+      blob.loading = true;
+      const auto spilled = blob.spilled;
+      blob_lock.unlock();
+      std::string data(spilled.size, '\0');
+      const auto read = ::pread(fileno(file), data.data(), data.size(), spilled.offset);
+      const auto error = errno;
+      auto body = read == ssize_t(data.size()) ? std::make_shared<const std::string>(std::move(data)) : nullptr;
+      blob_lock.lock();
+      // Released and erased meanwhile if its last block went away
+      if(const auto l_it = blobs.find(digest); l_it != blobs.end()){
+        l_it->second.loading = false;
+        if(body && l_it->second.body.expired()) l_it->second.body = body;
+      }
+      loaded_cv.notify_all();
+      if(!body) throw std::runtime_error("body store read failed : " + std::string(std::strerror(error)));
+      return body;
+    }
+  }
+
+  // Spills least recently used bodies until the limits hold. They come from
+  // shard, which the caller has locked, while it holds more than the body
+  // just used, then from any other shard that is free, and only then is that
+  // body spilled too. Other shards are only tried, so two stores evicting at
+  // once never wait on each other.
+  void evict(Shard& shard) const {
+    const auto self = &shard - shards.data();
+    while(overLimits()){
+      if(shard.lru.size() > 1){
+        spill(shard);
+        continue;
+      }
+      bool spilled = false;
+      for(std::size_t i = 1; i < BODY_SHARDS && !spilled; i++){
+        auto& other = shards[(self + i) % BODY_SHARDS];
+        if(!other.mutex.try_lock()) continue;
+        std::scoped_lock other_lock(std::adopt_lock, other.mutex);
+        if(!other.lru.empty()){
+          spill(other);
+          spilled = true;
+        }
+      }
+      if(spilled) continue;
+      if(shard.lru.empty()) return;
+      spill(shard);
+    }
+  }
+
+  // Drops the shard's least recently used body from memory. A body already
+  // in the file, written for this block or another holding the same data, is
+  // just dropped. Bodies no block holds any more leave their copy behind, the
+  // file is not compacted. Needs the shard's mutex.
+  void spill(Shard& shard) const {
+    const auto idx = shard.lru.back();
+    const auto r_it = shard.resident.find(idx);
+    const auto& body = *r_it->second.body;
+    const auto& digest = shard.slots[idx / BODY_SHARDS].digest;
+    // The slot keeps the blob alive while the shard is locked, the write
+    // happens outside blob_mutex. Two shards spilling the same body at once
+    // may both write it, the later copy is left unused.
+    std::unique_lock blob_lock(blob_mutex);
+    const auto spilled = blobs.at(digest).spilled.valid;
+    blob_lock.unlock();
+    if(!spilled){
+      const auto offset = file_end.fetch_add(body.size());
+      if(::pwrite(fileno(file), body.data(), body.size(), offset) != ssize_t(body.size())){
+        throw std::runtime_error("body store write failed : " + std::string(std::strerror(errno)));
+      }
+      blob_lock.lock();
+      auto& s = blobs.at(digest).spilled;
+      if(!s.valid) s = Spilled{offset, std::uint32_t(body.size()), true};
+      blob_lock.unlock();
+    }
+    account(-std::int64_t(body.size()), -1);
+    shard.resident.erase(r_it);
+    shard.lru.pop_back();
+  }
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef __HASH_INDEX_HPP__
+#define __HASH_INDEX_HPP__
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <optional>
+
+#include "Block.hpp"
+
+// Open-addressing (linear probing) map from block chash to chain index.
+// Slots keep a 64-bit fingerprint of the digest instead of the full 64 hex
+// chars, lookups confirm a candidate against the chain through a callback.
+class HashIndex {
+
+  static constexpr Idx EMPTY = std::numeric_limits<Idx>::max();
+
+  struct Slot {
+    std::uint64_t key;
+    Idx idx = EMPTY;
+  };
+
+private:
+
+  std::vector<Slot> slots = std::vector<Slot>(16);
+  std::size_t count = 0;
+
+public:
+
+  // The chash is hex encoded SHA-256, its leading 16 digits are already uniform
+  static std::uint64_t fingerprint(const std::string& chash){
+    std::uint64_t key = 0;
+    for(std::size_t i = 0; i < 16 && i < chash.size(); i++){
+      const char c = chash[i];
+      key = (key << 4) | (c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10 : c - '0');
+    }
+    return key;
+  }
+
+  void insert(const std::string& chash, Idx idx){
+    if((count + 1) * 10 > slots.size() * 7){
+      grow();
+    }
+    place(fingerprint(chash), idx);
+  }
+
+  // Removes the entry for chash at idx, other entries sharing the fingerprint stay
+  void erase(const std::string& chash, Idx idx){
+    const auto key = fingerprint(chash);
+    const auto mask = slots.size() - 1;
+    for(auto pos = key & mask; slots[pos].idx != EMPTY; pos = (pos + 1) & mask){
+      if(slots[pos].key == key && slots[pos].idx == idx){
+        backshift(pos);
+        count--;
+        return;
+      }
+    }
+  }
+
+  std::optional<Idx> find(const std::string& chash, auto&& matches) const {
+    const auto key = fingerprint(chash);
+    const auto mask = slots.size() - 1;
+    for(auto pos = key & mask; slots[pos].idx != EMPTY; pos = (pos + 1) & mask){
+      if(slots[pos].key == key && matches(slots[pos].idx)){
+        return slots[pos].idx;
+      }
+    }
+    return std::nullopt;
+  }
+
+  void clear(){
+    slots.assign(16, Slot{});
+    count = 0;
+  }
+
+  auto size() const {
+    return count;
+  }
+
+private:
+
+  void place(std::uint64_t key, Idx idx){
+    const auto mask = slots.size() - 1;
+    auto pos = key & mask;
+    while(slots[pos].idx != EMPTY){
+      pos = (pos + 1) & mask;
+    }
+    slots[pos] = Slot{key, idx};
+    count++;
+  }
+
+  // Deletion without tombstones: pull later entries of the probe run into the hole
+  void backshift(std::size_t hole){
+    const auto mask = slots.size() - 1;
+    for(auto pos = (hole + 1) & mask; slots[pos].idx != EMPTY; pos = (pos + 1) & mask){
+      const auto home = slots[pos].key & mask;
+      if(((pos - home) & mask) >= ((pos - hole) & mask)){
+        slots[hole] = slots[pos];
+        hole = pos;
+      }
+    }
+    slots[hole] = Slot{};
+  }
+
+  void grow(){
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    count = 0;
+    for(const auto& slot : old){
+      if(slot.idx != EMPTY){
+        place(slot.key, slot.idx);
+      }
+    }
+  }
+
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __HEADER_STORE_HPP__
+#define __HEADER_STORE_HPP__
+
+#include <array>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+
+#include "Block.hpp"
+
+// Main chain headers as parallel arrays, one per field, indexed by block
+// index. Scans that only need hashes, like the link check, walk two dense
+// arrays of HASH_SIZE entries instead of striding over whole headers.
+class HeaderStore {
+
+  using Hash = std::array<char, HASH_SIZE>;
+
+private:
+
+  std::vector<Nonce> nonces;
+  std::vector<Timestamp> timestamps;
+  std::vector<Difficulty> difficulties;
+  // works[i] is the total work of blocks [0, i]
+  std::vector<Idx> works;
+  std::vector<Hash> phashes;
+  std::vector<Hash> chashes;
+
+public:
+
+  Idx size() const {
+    return chashes.size();
+  }
+
+  void push(const Block& block){
+    nonces.push_back(block.get_nonce());
+    timestamps.push_back(block.get_timestamp());
+    difficulties.push_back(block.get_difficulty());
+    works.push_back((works.empty() ? 0 : works.back()) + difficultyWork(block.get_difficulty()));
+    phashes.emplace_back();
+    chashes.emplace_back();
+    set(size() - 1, block);
+  }
+
+  void set(Idx idx, const Block& block){
+    nonces[idx] = block.get_nonce();
+    timestamps[idx] = block.get_timestamp();
+    if(difficulties[idx] != block.get_difficulty()){
+      difficulties[idx] = block.get_difficulty();
+      for(auto i = idx; i < works.size(); i++){
+        works[i] = (i > 0 ? works[i - 1] : 0) + difficultyWork(difficulties[i]);
+      }
+    }
+    block.get_phash().copy(phashes[idx].data(), HASH_SIZE);
+    block.get_chash().copy(chashes[idx].data(), HASH_SIZE);
+  }
+
+  // Drops headers from length on
+  void truncate(Idx length){
+    nonces.resize(length);
+    timestamps.resize(length);
+    difficulties.resize(length);
+    works.resize(length);
+    phashes.resize(length);
+    chashes.resize(length);
+  }
+
+  Nonce nonce(Idx idx) const {
+    return nonces[idx];
+  }
+
+  Timestamp timestamp(Idx idx) const {
+    return timestamps[idx];
+  }
+
+  Difficulty difficulty(Idx idx) const {
+    return difficulties[idx];
+  }
+
+  // Total work of blocks [0, idx]
+  Idx work(Idx idx) const {
+    return works[idx];
+  }
+
+  std::string_view phash(Idx idx) const {
+    return std::string_view(phashes[idx].data(), HASH_SIZE);
+  }
+
+  std::string_view chash(Idx idx) const {
+    return std::string_view(chashes[idx].data(), HASH_SIZE);
+  }
+
+  BlockHeader header(Idx idx) const {
+    return BlockHeader(idx, nonces[idx], phash(idx), chash(idx), timestamps[idx], difficulties[idx]);
+  }
+
+  // First index in [from, to) whose phash is not the chash before it, or to
+  Idx findBrokenLink(Idx from, Idx to) const {
+    to = std::min(to, size());
+    for(from = std::max<Idx>(from, 1); from < to; from++){
+      if(std::memcmp(phashes[from].data(), chashes[from - 1].data(), HASH_SIZE) != 0) return from;
+    }
+    return to;
+  }
+
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef __POW_CACHE_HPP__
+#define __POW_CACHE_HPP__
+
+#include <list>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+
+#include "Block.hpp"
+#include "../Metrics.hpp"
+
+// Winning nonces of the POW_CACHE_SIZE most recently mined or verified block prefixes
+static constexpr auto POW_CACHE_SIZE = 4096;
+
+// Winning nonce by WorkKey, least recently used entries evicted. Re-mining a
+// block whose data and header fields were seen before costs one hash instead
+// of a nonce search. Not synchronized, BlockChain's owner locks it.
+class PowCache {
+
+  struct KeyHash {
+    std::size_t operator()(const WorkKey& key) const {
+      std::size_t h;
+      std::memcpy(&h, key.data(), sizeof(h));
+      return h;
+    }
+  };
+
+  struct Entry {
+    Nonce nonce;
+    std::list<WorkKey>::iterator lru;
+  };
+
+private:
+
+  std::unordered_map<WorkKey, Entry, KeyHash> entries;
+  std::list<WorkKey> lru;
+
+  Counter *hits = nullptr;
+  Counter *misses = nullptr;
+
+public:
+
+  void bindMetrics(Metrics& metrics){
+    hits = &metrics.counter("pow_cache_hits");
+    misses = &metrics.counter("pow_cache_misses");
+  }
+
+  std::optional<Nonce> find(const WorkKey& key){
+    const auto e_it = entries.find(key);
+    if(e_it == entries.end()){
+      if(misses) misses->add();
+      return std::nullopt;
+    }
+    if(hits) hits->add();
+    lru.splice(lru.begin(), lru, e_it->second.lru);
+    return e_it->second.nonce;
+  }
+
+  void insert(const WorkKey& key, Nonce nonce){
+    if(const auto e_it = entries.find(key); e_it != entries.end()){
+      e_it->second.nonce = nonce;
+      lru.splice(lru.begin(), lru, e_it->second.lru);
+      return;
+    }
+    lru.push_front(key);
+    entries.emplace(key, Entry{nonce, lru.begin()});
+    if(entries.size() > POW_CACHE_SIZE){
+      entries.erase(lru.back());
+      lru.pop_back();
+    }
+  }
+
+};
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef __SNAPSHOT_HPP__
+#define __SNAPSHOT_HPP__
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+#include "Block.hpp"
+
+// Snapshot file layout, integers little endian:
+//   header : magic[8] version:u32 flags:u32 length:u64 genesis_phash[64]
+//   chunk  : blocks:u32 codec:u8 raw_size:u32 stored_size:u32 payload
+//   end    : a chunk of 0 blocks
+// Blocks in a chunk are consecutive, the index is implicit. Each one is
+//   varint nonce, varint timestamp_delta, varint difficulty,
+//   varint (data_len << 1 | has_phash), [phash[64]], chash[32], data
+// where phash is only stored when it is not the previous block's chash and
+// timestamp_delta is the difference to the previous block's, modulo 2^64.
+static constexpr char SNAPSHOT_MAGIC[8] = {'B', 'L', 'K', 'S', 'N', 'A', 'P', 0};
+static constexpr std::uint32_t SNAPSHOT_VERSION = 2;
+static constexpr std::uint32_t SNAPSHOT_COMPRESSED = 1;
+// Most blocks in a chunk, and most bytes one block takes in a chunk's raw
+// payload: four varints, phash, chash and data
+static constexpr auto SNAPSHOT_CHUNK = 1024;
+static constexpr auto SNAPSHOT_MAX_RECORD = 4 * 10 + HASH_SIZE + HASH_SIZE / 2 + DATA_SIZE;
+
+// LZ77 block codec in the style of LZ4. A sequence is a token (literal length
+// << 4 | match length - 4, 15 meaning more length bytes follow), the literals,
+// then a 16 bit offset and the extra match length. The last sequence has
+// literals only.
+class LZCodec {
+
+  static constexpr auto MIN_MATCH = 4;
+  static constexpr auto HASH_BITS = 12;
+  static constexpr auto MAX_OFFSET = 0xFFFF;
+
+public:
+
+  static std::string compress(const std::string& in){
+    std::string out;
+    out.reserve(in.size() / 2 + 16);
+    std::array<std::uint32_t, 1 << HASH_BITS> table{};
+    const auto *src = reinterpret_cast<const unsigned char*>(in.data());
+    const std::size_t n = in.size();
+    std::size_t anchor = 0;
+    std::size_t pos = 0;
+    while(pos + MIN_MATCH <= n){
+      const auto h = hash(src + pos);
+      const std::size_t candidate = table[h];
+      table[h] = pos + 1;
+      if(candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || std::memcmp(src + candidate - 1, src + pos, MIN_MATCH) != 0){
+        pos++;
+        continue;
+      }
+      const std::size_t match = candidate - 1;
+      std::size_t len = MIN_MATCH;
+      while(pos + len < n && src[match + len] == src[pos + len]) len++;
+      emit(out, in, anchor, pos - anchor, pos - match, len);
+      pos += len;
+      anchor = pos;
+    }
+    emit(out, in, anchor, n - anchor, 0, 0);
+    return out;
+  }
+
+  // Throws std::runtime_error on malformed input
+  static std::string decompress(const std::string& in, std::size_t raw_size){
+    std::string out;
+    out.reserve(raw_size);
+    std::size_t pos = 0;
+    auto byte = [&](){
+      if(pos >= in.size()) throw std::runtime_error("truncated compressed chunk");
+      return static_cast<unsigned char>(in[pos++]);
+    };
+    auto length = [&](std::size_t len){
+      if(len != 15) return len;
+      for(unsigned char b = 255; b == 255; len += b) b = byte();
+      return len;
+    };
+    while(pos < in.size()){
+      const auto token = byte();
+      const auto literals = length(token >> 4);
+      if(literals > in.size() - pos || out.size() + literals > raw_size){
+        throw std::runtime_error("corrupt compressed chunk");
+      }
+      out.append(in, pos, literals);
+      pos += literals;
+      if(pos == in.size()) break;
+      const std::size_t offset = byte() | (std::size_t(byte()) << 8);
+      const auto len = length(token & 0xF) + MIN_MATCH;
+      if(offset == 0 || offset > out.size() || out.size() + len > raw_size){
+        throw std::runtime_error("corrupt compressed chunk");
+      }
+      // Byte by byte, matches may overlap what they produce
+      for(std::size_t i = 0, from = out.size() - offset; i < len; i++){
+        out.push_back(out[from + i]);
+      }
+    }
+    if(out.size() != raw_size){
+      throw std::runtime_error("corrupt compressed chunk");
+    }
+    return out;
+  }
+
+private:
+
+  static std::uint32_t hash(const unsigned char *p){
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+  }
+
+  static void length(std::string& out, std::size_t len){
+    for(len -= 15; len >= 255; len -= 255) out.push_back(char(255));
+    out.push_back(char(len));
+  }
+
+  static void emit(std::string& out, const std::string& in, std::size_t from, std::size_t literals, std::size_t offset, std::size_t match){
+    const auto matchCode = match ? match - MIN_MATCH : 0;
+    out.push_back(char((std::min<std::size_t>(literals, 15) << 4) | std::min<std::size_t>(matchCode, 15)));
+    if(literals >= 15) length(out, literals);
+    out.append(in, from, literals);
+    if(!match) return;
+    out.push_back(char(offset & 0xFF));
+    out.push_back(char(offset >> 8));
+    if(matchCode >= 15) length(out, matchCode);
+  }
+
+};
+
+class SnapshotWriter {
+
+private:
+
+  std::ostream& out;
+  bool compress;
+  std::string prev_chash;
+  Timestamp prev_timestamp = 0;
+
+public:
+
+  SnapshotWriter(std::ostream& _out, bool _compress) : out(_out), compress(_compress) {}
+
+  void writeHeader(std::uint64_t length, const std::string& genesis_phash){
+    out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put<std::uint32_t>(SNAPSHOT_VERSION);
+    put<std::uint32_t>(compress ? SNAPSHOT_COMPRESSED : 0);
+    put<std::uint64_t>(length);
+    out.write(genesis_phash.data(), HASH_SIZE);
+    prev_chash = genesis_phash;
+  }
+
+  // At most SNAPSHOT_CHUNK blocks, readers reject larger chunks
+  void writeChunk(const std::vector<Block>& blocks){
+    std::string raw;
+    for(const auto& block : blocks){
+      const auto phash = block.get_phash();
+      const auto data = block.get_data();
+      const auto len = data.find('\0') == std::string::npos ? data.size() : data.find('\0');
+      const bool has_phash = phash != prev_chash;
+      varint(raw, block.get_nonce());
+      varint(raw, block.get_timestamp() - prev_timestamp);
+      varint(raw, block.get_difficulty());
+      prev_timestamp = block.get_timestamp();
+      varint(raw, (len << 1) | has_phash);
+      if(has_phash) raw += phash;
+      prev_chash = block.get_chash();
+      unhex(raw, prev_chash);
+      raw.append(data, 0, len);
+    }
+    std::string stored = compress ? LZCodec::compress(raw) : std::string();
+    const bool packed = compress && stored.size() < raw.size();
+    const auto& payload = packed ? stored : raw;
+    put<std::uint32_t>(blocks.size());
+    put<std::uint8_t>(packed);
+    put<std::uint32_t>(raw.size());
+    put<std::uint32_t>(payload.size());
+    out.write(payload.data(), payload.size());
+  }
+
+  void finish(){
+    put<std::uint32_t>(0);
+    out.flush();
+  }
+
+private:
+
+  template<typename T>
+  void put(T v){
+    char bytes[sizeof(T)];
+    for(std::size_t i = 0; i < sizeof(T); i++){
+      bytes[i] = char(std::uint64_t(v) >> (8 * i));
+    }
+    out.write(bytes, sizeof(bytes));
+  }
+
+  static void varint(std::string& s, std::uint64_t v){
+    for(; v >= 0x80; v >>= 7) s.push_back(char(v | 0x80));
+    s.push_back(char(v));
+  }
+
+  // 64 hex digits to 32 bytes, chashes are always lowercase hex
+  static void unhex(std::string& s, const std::string& hex){
+    auto nibble = [](char c){ return c <= '9' ? c - '0' : c - 'a' + 10; };
+    for(int i = 0; i < HASH_SIZE; i += 2){
+      s.push_back(char(nibble(hex[i]) << 4 | nibble(hex[i + 1])));
+    }
+  }
+
+};
+
+// Reads a snapshot back chunk by chunk. Throws std::runtime_error on a
+// malformed stream; block validity is left to the caller.
+class SnapshotReader {
+
+private:
+
+  std::istream& in;
+  std::uint64_t length = 0;
+  std::string prev_chash;
+  Timestamp prev_timestamp = 0;
+  Idx next_idx = 0;
+
+public:
+
+  explicit SnapshotReader(std::istream& _in) : in(_in) {}
+
+  // Returns the number of blocks in the snapshot
+  std::uint64_t readHeader(){
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if(!in || std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0){
+      throw std::runtime_error("not a snapshot");
+    }
+    if(get<std::uint32_t>() != SNAPSHOT_VERSION){
+      throw std::runtime_error("unsupported snapshot version");
+    }
+    get<std::uint32_t>();
+    length = get<std::uint64_t>();
+    prev_chash.resize(HASH_SIZE);
+    in.read(prev_chash.data(), HASH_SIZE);
+    return length;
+  }
+
+  // Appends the next chunk's blocks to out, false after the last chunk
+  bool readChunk(std::vector<Block>& out){
+    const auto count = get<std::uint32_t>();
+    if(count == 0){
+      if(next_idx != length) throw std::runtime_error("snapshot ended early");
+      return false;
+    }
+    const auto packed = get<std::uint8_t>();
+    const auto raw_size = get<std::uint32_t>();
+    const auto stored_size = get<std::uint32_t>();
+    // Sizes come from the file, they are checked before anything is allocated
+    if(count > SNAPSHOT_CHUNK || packed > 1 || raw_size > std::size_t(count) * SNAPSHOT_MAX_RECORD || stored_size > raw_size || (!packed && stored_size != raw_size)){
+      throw std::runtime_error("corrupt snapshot chunk");
+    }
+    std::string payload(stored_size, '\0');
+    in.read(payload.data(), stored_size);
+    if(!in) throw std::runtime_error("truncated snapshot");
+    const auto raw = packed ? LZCodec::decompress(payload, raw_size) : std::move(payload);
+
+    std::size_t pos = 0;
+    auto take = [&](std::size_t n){
+      if(n > raw.size() - pos) throw std::runtime_error("corrupt snapshot chunk");
+      pos += n;
+      return raw.data() + pos - n;
+    };
+    for(std::uint32_t b = 0; b < count; b++){
+      const auto nonce = varint(raw, pos);
+      prev_timestamp += varint(raw, pos);
+      const auto difficulty = varint(raw, pos);
+      const auto flags = varint(raw, pos);
+      const auto len = flags >> 1;
+      if(len > DATA_SIZE) throw std::runtime_error("corrupt snapshot chunk");
+      std::string phash = (flags & 1) ? std::string(take(HASH_SIZE), HASH_SIZE) : prev_chash;
+      prev_chash = hex(reinterpret_cast<const unsigned char*>(take(HASH_SIZE / 2)));
+      if(difficulty > MAX_DIFFICULTY) throw std::runtime_error("corrupt snapshot chunk");
+      out.emplace_back(next_idx++, nonce, phash, prev_chash, std::string(take(len), len), prev_timestamp, Difficulty(difficulty));
+    }
+    if(pos != raw.size() || next_idx > length){
+      throw std::runtime_error("corrupt snapshot chunk");
+    }
+    return true;
+  }
+
+private:
+
+  template<typename T>
+  T get(){
+    unsigned char bytes[sizeof(T)];
+    in.read(reinterpret_cast<char*>(bytes), sizeof(bytes));
+    if(!in) throw std::runtime_error("truncated snapshot");
+    std::uint64_t v = 0;
+    for(std::size_t i = 0; i < sizeof(T); i++){
+      v |= std::uint64_t(bytes[i]) << (8 * i);
+    }
+    return T(v);
+  }
+
+  static std::uint64_t varint(const std::string& s, std::size_t& pos){
+    std::uint64_t v = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+      if(pos >= s.size()) throw std::runtime_error("corrupt snapshot chunk");
+      const auto b = static_cast<unsigned char>(s[pos++]);
+      v |= std::uint64_t(b & 0x7F) << shift;
+      if(!(b & 0x80)) return v;
+    }
+    throw std::runtime_error("corrupt snapshot chunk");
+  }
+
+  static std::string hex(const unsigned char *bytes){
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string s(HASH_SIZE, '0');
+    for(int i = 0; i < HASH_SIZE / 2; i++){
+      s[2 * i] = digits[bytes[i] >> 4];
+      s[2 * i + 1] = digits[bytes[i] & 0xF];
+    }
+    return s;
+  }
+
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef __TOKEN_INDEX_HPP__
+#define __TOKEN_INDEX_HPP__
+
+#include <map>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <string_view>
+
+#include "Block.hpp"
+
+// Inverted index from the words of block data to the main chain blocks that
+// hold them. A token is a run of letters and digits, lowercased. Tokens are
+// kept in order, so every token sharing a prefix is one range of the map.
+class TokenIndex {
+
+private:
+
+  // Sorted block indices per token. Blocks mostly join at the tip, so
+  // inserts land at the end of their vectors.
+  std::map<std::string, std::vector<Idx>, std::less<>> postings;
+
+public:
+
+  void insert(Idx idx, std::string_view data){
+    forEachToken(data, [this, idx](std::string token, bool){
+      auto& blocks = postings[std::move(token)];
+      const auto b_it = std::upper_bound(blocks.begin(), blocks.end(), idx);
+      if(b_it == blocks.begin() || *std::prev(b_it) != idx){
+        blocks.insert(b_it, idx);
+      }
+    });
+  }
+
+  // data must be what was inserted for idx
+  void erase(Idx idx, std::string_view data){
+    forEachToken(data, [this, idx](std::string token, bool){
+      const auto p_it = postings.find(token);
+      if(p_it == postings.end()) return;
+      auto& blocks = p_it->second;
+      const auto b_it = std::lower_bound(blocks.begin(), blocks.end(), idx);
+      if(b_it != blocks.end() && *b_it == idx) blocks.erase(b_it);
+      if(blocks.empty()) postings.erase(p_it);
+    });
+  }
+
+  // Blocks whose data holds every token of query, in ascending order and at
+  // most limit of them. A token directly followed by '*' matches as a prefix.
+  std::vector<Idx> find(std::string_view query, std::size_t limit) const {
+    std::vector<Idx> result;
+    bool first = true;
+    forEachToken(query, [this, &result, &first](std::string token, bool prefix){
+      if(!first && result.empty()) return;
+      auto blocks = prefix ? matchPrefix(token) : match(token);
+      if(first){
+        result = std::move(blocks);
+        first = false;
+        return;
+      }
+      std::vector<Idx> both;
+      std::set_intersection(result.begin(), result.end(), blocks.begin(), blocks.end(), std::back_inserter(both));
+      result = std::move(both);
+    });
+    if(result.size() > limit) result.resize(limit);
+    return result;
+  }
+
+  std::size_t tokenCount() const {
+    return postings.size();
+  }
+
+private:
+
+  std::vector<Idx> match(const std::string& token) const {
+    const auto p_it = postings.find(token);
+    return p_it != postings.end() ? p_it->second : std::vector<Idx>();
+  }
+
+  std::vector<Idx> matchPrefix(const std::string& prefix) const {
+    std::vector<Idx> blocks;
+    for(auto p_it = postings.lower_bound(prefix); p_it != postings.end() && p_it->first.starts_with(prefix); ++p_it){
+      blocks.insert(blocks.end(), p_it->second.begin(), p_it->second.end());
+    }
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    return blocks;
+  }
+
+  // Calls fn(token, followed_by_star) for each token of text, NUL padding included
+  static void forEachToken(std::string_view text, auto&& fn){
+    std::size_t pos = 0;
+    while(pos < text.size()){
+      while(pos < text.size() && !std::isalnum(static_cast<unsigned char>(text[pos]))) pos++;
+      std::string token;
+      for(; pos < text.size() && std::isalnum(static_cast<unsigned char>(text[pos])); pos++){
+        token += std::tolower(static_cast<unsigned char>(text[pos]));
+      }
+      if(token.empty()) break;
+      const bool prefix = pos < text.size() && text[pos] == '*';
+      fn(std::move(token), prefix);
+    }
+  }
+
+};
+
+#endif
@@ -2,34 +2,143 @@
 #define __CLIENT_HANDLER_HPP__
 
 #include <iostream>
+#include <list>
 #include <unordered_map>
 #include <unordered_set>
 #include <thread>
 #include <chrono>
 #include <vector>
+#include <array>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <future>
 #include <queue>
+#include <condition_variable>
+#include <utility>
+#include <optional>
+#include <stdexcept>
+#include <functional>
+#include <algorithm>
 
 #include "BlockChain/BlockChain.hpp"
+#include "BlockChain/Snapshot.hpp"
 #include "PracticalSocket.hpp"
+#include "Transport.hpp"
+#include "EventLoop.hpp"
 #include "message.h"
 #include "EncoderDecoder.hpp"
+#include "ThreadPool.hpp"
+#include "Metrics.hpp"
 #include "log.h"
 
 static constexpr auto START_PORT = 50000;
 static constexpr auto END_PORT = 50100;
-static constexpr auto BUFFER_SIZE = 1024*2;
 static constexpr auto CHASH_QUEUE_SIZE = 1024 * 8;
 
+// Switch from per-block UDP requests to a TCP stream when this far behind a peer
+static constexpr auto BULK_SYNC_THRESHOLD = 64;
+// Blocks requested per bulk sync round trip, bounds how much a peer streams ahead
+static constexpr auto BULK_SYNC_WINDOW = 4096;
+// Blocks copied per bchain_mutex hold when serving, and applied per hold when receiving
+static constexpr auto BULK_SYNC_CHUNK = 256;
+// A bulk sync peer silent this long, in milliseconds, is dropped
+static constexpr auto BULK_SYNC_TIMEOUT = 10 * 1000;
+
+// Blocks per verification task
+static constexpr auto VERIFY_CHUNK = 1024;
+
+// Most blocks a data query returns
+static constexpr std::size_t FIND_LIMIT = 1000;
+
+// Chash and data requests a peer may make per second, and in one burst
+static constexpr auto PEER_REQUEST_RATE = 500.0;
+static constexpr auto PEER_REQUEST_BURST = 1000.0;
+// Identical requests arriving within this window share one multicast response
+static constexpr auto COALESCE_WINDOW = std::chrono::milliseconds(5);
+
+// Chash answers for an index are counted this long, unless every peer answers sooner
+static constexpr auto VOTE_WINDOW = std::chrono::milliseconds(250);
+// Quiet time before a digest round checks every peer for divergence
+static constexpr auto SYNC_IDLE = std::chrono::milliseconds(350);
+// An unanswered digest probe ends the search with that peer until the next round
+static constexpr auto DIGEST_TIMEOUT = std::chrono::milliseconds(250);
+
 static constexpr auto IP_ADDR = "127.0.0.1";
 
 using Idx = unsigned long long int;
 
+// Node metrics resolved once from the registry so hot paths never look them up
+struct NodeMetrics {
+  std::array<Counter*, MESSAGE_TYPES> msgs_in;
+  std::array<Counter*, MESSAGE_TYPES> msgs_out;
+  Counter &msgs_in_total, &msgs_out_total;
+  Counter &bytes_in, &bytes_out;
+  Counter &decode_errors;
+  Counter &requests_throttled, &requests_coalesced;
+  Counter &bodies_skipped;
+  Counter &hashes_tried, &blocks_mined;
+  Histogram &mining_time_ns;
+  Histogram &vote_window_ns;
+  Histogram &bchain_lock_wait_ns, &peer_lock_wait_ns;
+  Gauge &chash_queue_depth;
+
+  explicit NodeMetrics(Metrics& m) :
+    msgs_in_total(m.counter("msgs_in")), msgs_out_total(m.counter("msgs_out")),
+    bytes_in(m.counter("bytes_in")), bytes_out(m.counter("bytes_out")),
+    decode_errors(m.counter("decode_errors")),
+    requests_throttled(m.counter("requests_throttled")), requests_coalesced(m.counter("requests_coalesced")),
+    bodies_skipped(m.counter("bulk_sync_bodies_skipped")),
+    hashes_tried(m.counter("hashes_tried")), blocks_mined(m.counter("blocks_mined")),
+    mining_time_ns(m.histogram("mining_time_ns")),
+    vote_window_ns(m.histogram("vote_window_ns")),
+    bchain_lock_wait_ns(m.histogram("bchain_lock_wait_ns")), peer_lock_wait_ns(m.histogram("peer_lock_wait_ns")),
+    chash_queue_depth(m.gauge("chash_queue_depth")) {
+    for(std::size_t t = 0; t < MESSAGE_TYPES; t++){
+      msgs_in[t] = &m.counter(std::string("msgs_in.") + MESSAGE_TYPE_NAMES[t]);
+      msgs_out[t] = &m.counter(std::string("msgs_out.") + MESSAGE_TYPE_NAMES[t]);
+    }
+  }
+};
+
 class ClientHandler{
 
+  // Called with bchain_mutex held for every block that joins the main chain
+  using BlockListener = std::function<void(Idx, const std::string&)>;
+
+
   using Clock = std::chrono::high_resolution_clock;
   using TimePoint = std::chrono::time_point<Clock>;
 
+  // Chash answers for one index, open until quorum peers answered or VOTE_WINDOW passed
+  struct ChashVote {
+    std::unordered_map<std::string, std::vector<unsigned short>> chashes;
+    std::unordered_map<unsigned short, Idx> peer_lengths;
+    std::size_t quorum = 0;
+    std::shared_ptr<Reply<bool>> closed = std::make_shared<Reply<bool>>();
+  };
+
+  struct TokenBucket {
+    double tokens = PEER_REQUEST_BURST;
+    TimePoint last = Clock::now();
+  };
+
+  // Chash and data request state, one shard per listener so handlers and
+  // responders on different shards never contend. A peer's bucket lives in
+  // the shard of its port, a request in the shard of its key, so identical
+  // requests still meet and share one response.
+  struct alignas(CACHE_LINE) RequestShard {
+    std::mutex limiter_mutex;
+    // Request budget per peer receive port
+    std::unordered_map<unsigned short, TokenBucket> buckets;
+
+    std::mutex coalesce_mutex;
+    std::condition_variable coalesce_cv;
+    // Requests waiting for the shard's responder, with the ports that asked for them
+    std::unordered_map<Idx, std::unordered_set<unsigned short>> pending_chash;
+    std::unordered_map<std::string, std::unordered_set<unsigned short>> pending_data;
+  };
+
 private:
 
   std::unordered_set<unsigned short> peer_ports;
@@ -37,38 +146,103 @@ private:
   unsigned short s_port;
   unsigned short r_port;
 
-  UDPSocket *s_sock;
-  UDPSocket *r_sock;
+  std::unique_ptr<Transport> sender;
+  // One per listener thread, all bound to r_port
+  std::vector<std::unique_ptr<Transport>> receivers;
+  TCPServerSocket *bulk_sock;
+
 
-  char recvBuffer[BUFFER_SIZE];
-  char sendBuffer[BUFFER_SIZE];
+  // IP_ADDR resolved once, peers differ only in the port
+  sockaddr_in peer_addr;
 
-  std::mutex send_mutex;
-  std::mutex bchain_mutex;
-  std::mutex peer_mutex;
-  std::mutex chash_q_mutex;
+  Metrics metrics;
+  NodeMetrics node_metrics{metrics};
+  MetricsExporter metrics_exporter;
+
+  TimedMutex<std::shared_mutex> bchain_mutex{node_metrics.bchain_lock_wait_ns};
+  TimedMutex<std::mutex> peer_mutex{node_metrics.peer_lock_wait_ns};
+  std::mutex data_q_mutex;
+  std::mutex miner_mutex;
+  std::mutex snapshot_mutex;
+  std::mutex mining_mutex;
 
   EncoderDecoder encoder, decoder;
 
-  std::thread listener_thread;
+  std::vector<std::thread> listener_threads;
   std::thread synchronizer;
+  std::thread bulk_server;
+  // One per request shard
+  std::vector<std::thread> responders;
+
+  // Bulk sync connections being served, each on its own thread
+  std::mutex bulk_mutex;
+  struct BulkConnection {
+    std::unique_ptr<TCPSocket> conn;
+    std::thread thread;
+    // Set under bulk_mutex as the connection ends, its thread is then joined on the next accept
+    bool done = false;
+  };
+  std::list<BulkConnection> bulk_connections;
+
+  std::atomic<bool> running{false};
+  std::atomic<bool> bulk_syncing{false};
+  ThreadPool pool;
+  EventLoop sync_loop;
 
   BlockChain bchain;
 
-  std::queue<chash_response> chash_queue;
+  // Sync state, touched only on the sync_loop thread
+  std::unordered_map<Idx, ChashVote> votes;
+  // Digest probe each searching peer owes us
+  std::unordered_map<unsigned short, std::pair<Idx, std::shared_ptr<Reply<digest_response>>>> digest_probes;
+  EventLoop::Clock::time_point last_sync = EventLoop::Clock::now();
+
+  std::vector<std::unique_ptr<RequestShard>> request_shards;
+
+  // Records waiting to be mined, drained in order by a single pool task
+  std::queue<std::pair<std::vector<std::string>, std::promise<Idx>>> data_queue;
+  bool draining_data = false;
+
+  // Token of the block currently being mined and the index it will occupy
+  std::shared_ptr<std::atomic<bool>> mining_cancel;
+  Idx mining_idx = 0;
+
+  BlockListener block_listener;
 
 public:
-  ClientHandler() {
+  // listeners receive sockets share r_port, each read by its own thread
+  explicit ClientHandler(unsigned listeners = 1, TransportKind transport = TransportKind::Socket) {
+    std::srand(std::time(0));
+    fillAddr(IP_ADDR, 0, peer_addr);
+    UDPSocket *s_sock;
     s_port = allocatePort(s_sock);
-    r_port = allocatePort(r_sock);
+    sender = openTransport(s_sock, transport);
+    r_port = allocateReceivePort(std::max(listeners, 1u), transport);
+    for(std::size_t i = 0; i < receivers.size(); i++){
+      request_shards.push_back(std::make_unique<RequestShard>());
+    }
+    bchain.bindMetrics(metrics);
     dmsg("Send Port : " << s_port);
     dmsg("Receive Port : " << r_port);
   }
 
+  ~ClientHandler(){
+    stop();
+    delete bulk_sock;
+  }
+
   void start(){
+    running = true;
+    pool.start();
     sendConnectMessages();
-    listener_thread = std::thread([this](){ listen(); });
-    synchronizer = std::thread([this](){ startSyanchronizer(); });
+    for(auto& receiver : receivers){
+      listener_threads.emplace_back([this, &receiver](){ listen(*receiver); });
+    }
+    synchronizer = std::thread([this](){ runSynchronizer(); });
+    bulk_server = std::thread([this](){ serveBulkSync(); });
+    for(auto& shard : request_shards){
+      responders.emplace_back([this, &shard = *shard](){ respondToRequests(shard); });
+    }
   }
 
   void printPeers() {
@@ -79,28 +253,306 @@ public:
   }
 
   void printBlockChain() {
-    std::scoped_lock bchain_lock(bchain_mutex);
+    std::shared_lock bchain_lock(bchain_mutex);
     bchain.printChain();
   }
 
-  void addData(const std::string& data){
-    std::scoped_lock bchain_lock(bchain_mutex);
-    bchain.addData(data);
+  auto getLength() {
+    std::shared_lock bchain_lock(bchain_mutex);
+    return bchain.getLength();
+  }
+
+  auto getChash(Idx idx) {
+    std::shared_lock bchain_lock(bchain_mutex);
+    return bchain.getChash(idx);
+  }
+
+  // nonce, phash, chash and data of block idx, nullopt past the tip
+  auto getBlock(Idx idx) {
+    std::shared_lock bchain_lock(bchain_mutex);
+    using BlockFields = decltype(bchain.getBlock(idx));
+    return idx < bchain.getLength() ? std::optional<BlockFields>(bchain.getBlock(idx)) : std::nullopt;
+  }
+
+  // Blocks whose data holds every word of query, a word ending in '*' as a prefix
+  std::vector<Idx> findData(const std::string& query, std::size_t limit = FIND_LIMIT) {
+    std::shared_lock bchain_lock(bchain_mutex);
+    return bchain.findData(query, limit);
   }
 
-  void updateData(Idx idx, const std::string& data){
+  Metrics& getMetrics() {
+    return metrics;
+  }
+
+  // Port peers send requests to, shared by every listener
+  unsigned short getReceivePort() const {
+    return r_port;
+  }
+
+  void dumpMetrics(std::ostream& out, bool json){
+    if(json) metrics.dumpJson(out);
+    else metrics.dumpText(out);
+  }
+
+  // Rewrites the metrics as JSON to path every interval until stop()
+  void exportMetrics(const std::string& path, std::chrono::milliseconds interval){
+    metrics_exporter.start(metrics, path, interval);
+  }
+
+  // Keeps block bodies in memory only within limits, older ones are read back from path
+  void setPruning(BodyStore::Limits limits, const std::string& path = std::string()){
     std::scoped_lock bchain_lock(bchain_mutex);
-    bchain.updateData(idx, data);
+    bchain.setPruning(limits, path);
+  }
+
+  // Must be set before start()
+  void setBlockListener(BlockListener listener){
+    block_listener = std::move(listener);
+  }
+
+  // Queues data to be mined into a new block, resolves to the index it landed at.
+  // Records are mined in submission order by one pool worker, so any number
+  // can be pipelined without tying up the pool.
+  std::future<Idx> addData(const std::string& data){
+    return addBatch({data});
+  }
+
+  // Queues records to be mined into consecutive blocks that join the chain
+  // together, resolves to the index of the first one
+  std::future<Idx> addBatch(std::vector<std::string> records){
+    std::promise<Idx> promise;
+    auto result = promise.get_future();
+    if(records.empty()){
+      promise.set_exception(std::make_exception_ptr(std::invalid_argument("empty batch")));
+      return result;
+    }
+    std::unique_lock data_q_lock(data_q_mutex);
+    data_queue.emplace(std::move(records), std::move(promise));
+    if(std::exchange(draining_data, true)) return result;
+    data_q_lock.unlock();
+    pool.submit([this](){ drainDataQueue(); });
+    return result;
+  }
+
+  auto updateData(Idx idx, const std::string& data){
+    return pool.submit([this, idx, data](){
+      std::scoped_lock bchain_lock(bchain_mutex);
+      if(idx >= bchain.getLength()){
+        throw std::out_of_range("no block " + std::to_string(idx));
+      }
+      node_metrics.hashes_tried.add(bchain.updateData(idx, data));
+      cancelStaleMining(idx);
+    });
+  }
+
+  // Splits the chain into VERIFY_CHUNK ranges checked in parallel on the pool.
+  // Must not be called from a pool task, it blocks on the range results
+  bool verifyChain(){
+    std::shared_lock bchain_lock(bchain_mutex);
+    const auto length = bchain.getLength();
+    bchain_lock.unlock();
+    std::vector<std::future<bool>> results;
+    for(Idx from = 0; from < length; from += VERIFY_CHUNK){
+      results.push_back(pool.submit([this, from](){
+        std::shared_lock bchain_lock(bchain_mutex);
+        return bchain.verifyRange(from, from + VERIFY_CHUNK);
+      }));
+    }
+    bool valid = true;
+    for(auto& result : results){
+      valid = result.get() && valid;
+    }
+    return valid;
+  }
+
+  // Streams a point-in-time snapshot of the main chain, holding bchain_mutex
+  // only to copy each SNAPSHOT_CHUNK blocks. Returns the number of blocks.
+  Idx exportSnapshot(std::ostream& out, bool compress = true){
+    std::scoped_lock snapshot_lock(snapshot_mutex);
+    std::unique_lock bchain_lock(bchain_mutex);
+    const auto length = bchain.beginSnapshot();
+    const auto genesis_phash = bchain.snapshotBlock(0).get_phash();
+    bchain_lock.unlock();
+
+    try{
+      SnapshotWriter writer(out, compress);
+      writer.writeHeader(length, genesis_phash);
+      std::vector<Block> blocks;
+      for(Idx from = 0; from < length; from += SNAPSHOT_CHUNK){
+        blocks.clear();
+        {
+          std::shared_lock bchain_read_lock(bchain_mutex);
+          for(auto idx = from; idx < length && idx < from + SNAPSHOT_CHUNK; idx++){
+            blocks.push_back(bchain.snapshotBlock(idx));
+          }
+        }
+        writer.writeChunk(blocks);
+      }
+      writer.finish();
+    }
+    catch(...){
+      bchain_lock.lock();
+      bchain.endSnapshot();
+      throw;
+    }
+    bchain_lock.lock();
+    bchain.endSnapshot();
+    return length;
+  }
+
+  // Reads and verifies a snapshot a chunk at a time. Its blocks extend the
+  // chain as they are read, or replace a suffix of it once they carry more
+  // work. Returns the resulting chain length.
+  Idx importSnapshot(std::istream& in){
+    SnapshotReader reader(in);
+    reader.readHeader();
+    BlockChain::ChainImport import;
+    std::vector<Block> blocks;
+    while(reader.readChunk(blocks)){
+      std::scoped_lock bchain_lock(bchain_mutex);
+      if(const auto first = bchain.importBlocks(import, blocks)){
+        notifyBlocks(*first);
+        cancelStaleMining(bchain.getLength() - 1);
+      }
+      blocks.clear();
+    }
+    std::shared_lock bchain_lock(bchain_mutex);
+    return bchain.getLength();
   }
 
   void disconnect(){
+    stop();
+  }
+
+  // Announces the disconnect, joins the network threads, then drains the pool
+  void stop(){
+    if(!running.exchange(false)) return;
     sendDisconnectMessage();
+    bulk_sock->shutdown();
+    for(auto& receiver : receivers){
+      receiver->shutdown();
+    }
+    for(auto& listener : listener_threads){
+      listener.join();
+    }
+    listener_threads.clear();
+    sync_loop.stop();
+    synchronizer.join();
+    bulk_server.join();
+    std::unique_lock bulk_lock(bulk_mutex);
+    for(auto& connection : bulk_connections){
+      connection.conn->shutdown();
+    }
+    auto served = std::move(bulk_connections);
+    bulk_lock.unlock();
+    for(auto& connection : served){
+      connection.thread.join();
+    }
+    for(auto& shard : request_shards){
+      {
+        std::scoped_lock coalesce_lock(shard->coalesce_mutex);
+      }
+      shard->coalesce_cv.notify_all();
+    }
+    for(auto& responder : responders){
+      responder.join();
+    }
+    responders.clear();
+    pool.stop();
+    metrics_exporter.stop();
   }
 
 private:
 
+  void drainDataQueue(){
+    while(true){
+      std::unique_lock data_q_lock(data_q_mutex);
+      if(data_queue.empty()){
+        draining_data = false;
+        return;
+      }
+      auto [records, promise] = std::move(data_queue.front());
+      data_queue.pop();
+      data_q_lock.unlock();
+      try{
+        promise.set_value(mine(records));
+      }
+      catch(...){
+        promise.set_exception(std::current_exception());
+      }
+    }
+  }
+
+  // Mines records into consecutive blocks without holding bchain_mutex, then
+  // appends them in one step. If the tip changes meanwhile the run is
+  // cancelled through mining_cancel and the batch restarts on the new tip.
+  Idx mine(const std::vector<std::string>& records){
+    // Fails before any record is mined
+    for(const auto& record : records){
+      Block::check_data(record);
+    }
+
+    std::scoped_lock miner_lock(miner_mutex);
+    while(true){
+      auto cancel = std::make_shared<std::atomic<bool>>(false);
+      std::shared_lock bchain_read_lock(bchain_mutex);
+      std::vector<Block> blocks{bchain.nextBlock(records.front())};
+      {
+        std::scoped_lock mining_lock(mining_mutex);
+        mining_cancel = cancel;
+        mining_idx = blocks.front().get_index();
+      }
+      bchain_read_lock.unlock();
+
+      bool mined = true;
+      blocks.reserve(records.size());
+      for(std::size_t r = 0; mined && r < records.size(); r++){
+        if(r > 0){
+          // Its difficulty depends on the blocks before it, pending ones included
+          std::shared_lock read_lock(bchain_mutex);
+          blocks.push_back(bchain.nextBlock(blocks, records[r]));
+        }
+        auto& block = blocks.back();
+        const auto start = std::chrono::steady_clock::now();
+        mined = block.mine_block(*cancel);
+        node_metrics.hashes_tried.add(block.get_nonce());
+        if(mined){
+          node_metrics.mining_time_ns.recordSince(start);
+          node_metrics.blocks_mined.add();
+        }
+      }
+      if(!mined){
+        dmsg("abandoned stale block " << blocks.back().get_index());
+        continue;
+      }
+
+      std::scoped_lock bchain_lock(bchain_mutex);
+      if(bchain.appendBlocks(blocks)){
+        notifyBlocks(blocks.front().get_index());
+        std::scoped_lock mining_lock(mining_mutex);
+        mining_cancel.reset();
+        return blocks.front().get_index();
+      }
+    }
+  }
+
+  // Called with bchain_mutex held after the main chain changed from index `from`
+  void notifyBlocks(Idx from){
+    if(!block_listener) return;
+    for(auto idx = from; idx < bchain.getLength(); idx++){
+      block_listener(idx, bchain.getChash(idx));
+    }
+  }
+
+  // Called with bchain_mutex held after the block at idx changed
+  void cancelStaleMining(Idx idx){
+    std::scoped_lock mining_lock(mining_mutex);
+    if(mining_cancel && idx + 1 >= mining_idx){
+      mining_cancel->store(true);
+    }
+  }
+
   unsigned short allocatePort(auto& sock){
-    std::srand(std::time(0));
     while(true){
       unsigned short rand_port = std::rand()%(END_PORT-START_PORT + 1) + START_PORT;
       try{
@@ -109,24 +561,80 @@ private:
         return rand_port;
       }
       catch(SocketException &exp){
-        err("failed to acquire socket on port " << rand_port);
+        wmsg("failed to acquire socket on port " << rand_port);
         continue;
       }
     }
   }
 
+  // Bulk sync listens on TCP with the same port number as the UDP receive
+  // sockets. Several receive sockets share the port through SO_REUSEPORT and
+  // the kernel spreads datagrams across them by sender.
+  unsigned short allocateReceivePort(unsigned listeners, TransportKind transport){
+    while(true){
+      unsigned short port = std::rand()%(END_PORT-START_PORT + 1) + START_PORT;
+      std::vector<std::unique_ptr<UDPSocket>> socks;
+      try{
+        dmsg("acquiring " << listeners << " receive sockets on " << port);
+        for(unsigned l = 0; l < listeners; l++){
+          socks.emplace_back(new UDPSocket(port, listeners > 1));
+        }
+        bulk_sock = new TCPServerSocket(port);
+      }
+      catch(SocketException &exp){
+        err("failed to acquire receive sockets on port " << port);
+        continue;
+      }
+      for(auto& sock : socks){
+        receivers.push_back(openTransport(sock.release(), transport));
+      }
+      return port;
+    }
+  }
+
+  // Each thread encodes into its own buffer and sendto is safe to call
+  // concurrently on one socket, so senders never wait on each other
   void send(unsigned short foreignPort, auto encoding_fn){
-    std::scoped_lock send_lock(send_mutex);
-    int bufferLen = encoding_fn(sendBuffer);
-    s_sock->sendTo(sendBuffer, bufferLen, IP_ADDR, foreignPort);
+    const std::array<unsigned short, 1> ports{foreignPort};
+    sendMultiple(ports, encoding_fn);
   }
 
-  void sendMultiple(auto& foreignPorts, auto encoding_fn){
-    std::scoped_lock send_lock(send_mutex);
-    int bufferLen = encoding_fn(sendBuffer);
+  void sendMultiple(const auto& foreignPorts, auto encoding_fn){
+    static thread_local char buffer[BUFFER_SIZE];
+    static thread_local std::vector<sockaddr_in> addrs;
+    int bufferLen = encoding_fn(buffer);
+    addrs.assign(foreignPorts.size(), peer_addr);
+    auto a_it = addrs.begin();
     for(auto port: foreignPorts){
-      s_sock->sendTo(sendBuffer, bufferLen, IP_ADDR, port);
+      (a_it++)->sin_port = htons(port);
     }
+    sender->sendTo(buffer, bufferLen, addrs.data(), addrs.size());
+    countSent(decoder.decodeMessageType(buffer), foreignPorts.size(), (unsigned long long)bufferLen * foreignPorts.size());
+  }
+
+  // Snapshot of the peer set, so sends happen without holding peer_mutex
+  std::vector<unsigned short> getPeers(){
+    std::scoped_lock peer_lock(peer_mutex);
+    return std::vector<unsigned short>(peer_ports.begin(), peer_ports.end());
+  }
+
+  void countSent(MessageType type, unsigned long long msgs, unsigned long long bytes){
+    node_metrics.msgs_out[type]->add(msgs);
+    node_metrics.msgs_out_total.add(msgs);
+    node_metrics.bytes_out.add(bytes);
+  }
+
+  void countRecv(MessageType type, unsigned long long msgs, unsigned long long bytes){
+    node_metrics.msgs_in[type]->add(msgs);
+    node_metrics.msgs_in_total.add(msgs);
+    node_metrics.bytes_in.add(bytes);
+  }
+
+  // A datagram is decodable if it holds a whole header of a known type and its declared size
+  bool isValidMessage(const char *message, int size){
+    if(size < (int)sizeof(MessageHeader)) return false;
+    const auto* const header = (MessageHeader *)(message);
+    return (unsigned)header->msgType < MESSAGE_TYPES && header->packetSize == (unsigned)size;
   }
 
   void sendConnectMessages(){
@@ -137,163 +645,352 @@ private:
   }
 
   void sendDisconnectMessage(){
-    std::scoped_lock peer_lock(peer_mutex);
-    sendMultiple(peer_ports, [this](auto& buffer){ return encoder.encodeDisconnectMsg(buffer, s_port, r_port); });
+    sendMultiple(getPeers(), [this](auto& buffer){ return encoder.encodeDisconnectMsg(buffer, s_port, r_port); });
   }
 
   void sendChashRequest(Idx index){
-    std::scoped_lock peer_lock(peer_mutex);
-    sendMultiple(peer_ports, [this, index](auto& buffer){ return encoder.encodeRequestChashMsg(buffer, s_port, r_port, index); });
+    sendMultiple(getPeers(), [this, index](auto& buffer){ return encoder.encodeRequestChashMsg(buffer, s_port, r_port, index); });
   }
 
-  void sendDataRequest(Idx index, const std::string& chash, const auto port){
-    send(port, [this, index, &chash](auto& buffer){ return encoder.encodeRequestDataMsg(buffer, s_port, r_port, index, chash); });
+  void sendDigestRequest(Idx length){
+    sendMultiple(getPeers(), [this, length](auto& buffer){ return encoder.encodeRequestDigestMsg(buffer, s_port, r_port, length); });
   }
 
-  void listen(){
-    int totalRecvMsgSize = 0;
+  void sendDigestRequest(Idx length, unsigned short port){
+    send(port, [this, length](auto& buffer){ return encoder.encodeRequestDigestMsg(buffer, s_port, r_port, length); });
+  }
 
-    while(true){
+  void sendDataRequest(Idx index, const std::string& chash, const auto port){
+    send(port, [this, index, &chash](auto& buffer){ return encoder.encodeRequestDataMsg(buffer, s_port, r_port, index, chash); });
+  }
 
-      totalRecvMsgSize = r_sock->recv(recvBuffer, BUFFER_SIZE, MSG_DONTWAIT);
-      if(totalRecvMsgSize < 0 && errno != EAGAIN) {
-          break; // Some error.
-      }
-      if(totalRecvMsgSize == -1 && errno == EAGAIN) {
-          std::this_thread::sleep_for(std::chrono::milliseconds(50));
-          continue;
-      }
-      if(totalRecvMsgSize == 0) {
-        break;
+  // Runs once per receive socket. Messages are handled on the pool, so
+  // handlers already run concurrently whatever the number of listeners.
+  void listen(Transport& receiver){
+    receiver.receive([this](const char *recvBuffer, int totalRecvMsgSize){
+      if(!isValidMessage(recvBuffer, totalRecvMsgSize)){
+        node_metrics.decode_errors.add();
+        return;
       }
+      countRecv(decoder.decodeMessageType(recvBuffer), 1, totalRecvMsgSize);
+      pool.submit([this, message = std::vector<char>(recvBuffer, recvBuffer + totalRecvMsgSize)](){ handleMessage(message.data()); });
+    }, running);
+  }
 
-      const auto* const messageHeader = (MessageHeader *)(recvBuffer);
+  void handleMessage(const char *message){
 
-      switch (messageHeader->msgType) {
+    const auto* const messageHeader = (MessageHeader *)(message);
 
-        case MessageType::ConnectMsg:{
-          unsigned short pport = encoder.decodeConnectMsg(recvBuffer);
-          send(pport, [this](auto& buffer){ return encoder.encodeConnectAckMsg(buffer, s_port, r_port); });
-          std::scoped_lock peer_lock(peer_mutex);
-          peer_ports.insert(pport);
-          break;
-        }
+    switch (messageHeader->msgType) {
 
-        case MessageType::ConnectAcknowledgementMsg:{
-          unsigned short pport = encoder.decodeConnectAckMsg(recvBuffer);
-          std::scoped_lock peer_lock(peer_mutex);
-          peer_ports.insert(pport);
-          break;
-        }
+      case MessageType::ConnectMsg:{
+        unsigned short pport = encoder.decodeConnectMsg(message);
+        send(pport, [this](auto& buffer){ return encoder.encodeConnectAckMsg(buffer, s_port, r_port); });
+        std::scoped_lock peer_lock(peer_mutex);
+        peer_ports.insert(pport);
+        break;
+      }
 
-        case MessageType::DisconnectMsg:{
-          unsigned short pport = encoder.decodeDisconnectMsg(recvBuffer);
+      case MessageType::ConnectAcknowledgementMsg:{
+        unsigned short pport = encoder.decodeConnectAckMsg(message);
+        std::scoped_lock peer_lock(peer_mutex);
+        peer_ports.insert(pport);
+        break;
+      }
+
+      case MessageType::DisconnectMsg:{
+        unsigned short pport = encoder.decodeDisconnectMsg(message);
+        {
           std::scoped_lock peer_lock(peer_mutex);
           const auto p_it = peer_ports.find(pport);
           if(p_it != peer_ports.end()){
             peer_ports.erase(p_it);
           }
         }
+        auto& shard = requestShard(pport);
+        std::scoped_lock limiter_lock(shard.limiter_mutex);
+        shard.buckets.erase(pport);
+        break;
+      }
 
-        case MessageType::RequestChashMsg:{
-          auto [index, send_to_port] = decoder.decodeRequestChashMsg(recvBuffer);
-          // dmsg("Recv Request Chash index:" << index << " port:" << send_to_port);
-          std::scoped_lock bchain_lock(bchain_mutex);
-          if(index < bchain.getLength()){
-            auto requestedHash = bchain.getChash(index);
-            send(send_to_port, [this, index, requestedHash](auto& buffer){ return encoder.encodeResponseHashMsg(buffer, s_port, r_port, index, requestedHash); });
-          }
-          break;
+      case MessageType::RequestChashMsg:{
+        auto [index, send_to_port] = decoder.decodeRequestChashMsg(message);
+        // dmsg("Recv Request Chash index:" << index << " port:" << send_to_port);
+        if(admitRequest(send_to_port)){
+          queueRequest(&RequestShard::pending_chash, index, send_to_port);
         }
+        break;
+      }
 
-        case MessageType::ResponseChashMsg:{
-          const auto res = decoder.decodeResponseChashMsg(recvBuffer);
-          // dmsg("Recv Respons Chash index:" << res.idx << " hash:" << res.chash);
-          std::scoped_lock chash_q_lock(chash_q_mutex);
-          chash_queue.push(res);
-          break;
-        }
+      case MessageType::ResponseChashMsg:{
+        const auto res = decoder.decodeResponseChashMsg(message);
+        // dmsg("Recv Respons Chash index:" << res.idx << " hash:" << res.chash);
+        node_metrics.chash_queue_depth.set(sync_loop.post([this, res](){ countVote(res); }));
+        break;
+      }
 
-        case MessageType::RequestDataMsg:{
-          auto [index, send_to_port] = decoder.decodeRequestDataMsg(recvBuffer);
-          // dmsg("Recv Request DATA index:" << index << " port:" << send_to_port);
-          std::scoped_lock bchain_lock(bchain_mutex);
-          if(index < bchain.getLength()){
-            auto [nonce, phash, chash, data] = bchain.getBlock(index);
-            send(send_to_port, [this, index, nonce, &phash, &chash, &data](auto& buffer){ return encoder.encodeResponseDataMsg(buffer, s_port, r_port, index, nonce, phash, chash, data); });
-          }
-          break;
+      case MessageType::RequestDataMsg:{
+        auto [requestedIdx, send_to_port, requestedHash] = decoder.decodeRequestDataMsg(message);
+        // dmsg("Recv Request DATA index:" << requestedIdx << " port:" << send_to_port);
+        if(admitRequest(send_to_port)){
+          queueRequest(&RequestShard::pending_data, requestedHash, send_to_port);
         }
+        break;
+      }
 
-        case MessageType::ResponseDataMsg:{
-          const auto& res = decoder.decodeResponseDataMsg(recvBuffer);
-          // dmsg("Recv Reespons DATA index:" << res.idx << " data:" << res.data);
-          std::scoped_lock bchain_lock(bchain_mutex);
-          bchain.updateBlock(res.idx, res.nonce, res.phash, res.chash, res.data);
-          if(res.idx < bchain.getLength()){
-            sendChashRequest(res.idx + 1);
-          }
-          break;
+      case MessageType::RequestDigestMsg:{
+        auto [length, send_to_port] = decoder.decodeRequestDigestMsg(message);
+        if(!admitRequest(send_to_port)) break;
+        std::shared_lock bchain_lock(bchain_mutex);
+        const auto chainLength = bchain.getLength();
+        const auto prefix = std::min<Idx>(length, chainLength);
+        const auto digest = bchain.prefixDigest(prefix);
+        bchain_lock.unlock();
+        send(send_to_port, [this, prefix, chainLength, &digest](auto& buffer){ return encoder.encodeResponseDigestMsg(buffer, s_port, r_port, prefix, chainLength, digest); });
+        break;
+      }
+
+      case MessageType::ResponseDigestMsg:{
+        sync_loop.post([this, res = decoder.decodeResponseDigestMsg(message)](){ routeDigest(res); });
+        break;
+      }
+
+      case MessageType::ResponseDataMsg:{
+        const auto& res = decoder.decodeResponseDataMsg(message);
+        // dmsg("Recv Reespons DATA index:" << res.idx << " data:" << res.data);
+        std::scoped_lock bchain_lock(bchain_mutex);
+        if(const auto changed = bchain.updateBlock(res.idx, res.nonce, res.phash, res.chash, res.data, res.timestamp, res.difficulty)){
+          notifyBlocks(*changed);
+          cancelStaleMining(bchain.getLength() - 1);
+        }
+        if(res.idx < bchain.getLength()){
+          sendChashRequest(res.idx + 1);
         }
+        break;
       }
+
+      default:
+        break;
     }
 
   }
 
-  void startSyanchronizer(){
-
-    static constexpr unsigned short INF = 65535;
+  // Takes a token from the peer's bucket, refilled at PEER_REQUEST_RATE.
+  // Requests beyond the budget are dropped, the peer asks again next round.
+  bool admitRequest(unsigned short port){
+    auto& shard = requestShard(port);
+    std::scoped_lock limiter_lock(shard.limiter_mutex);
+    auto& bucket = shard.buckets[port];
+    const auto now = Clock::now();
+    const std::chrono::duration<double> elapsed = now - bucket.last;
+    bucket.tokens = std::min(PEER_REQUEST_BURST, bucket.tokens + elapsed.count() * PEER_REQUEST_RATE);
+    bucket.last = now;
+    if(bucket.tokens < 1){
+      node_metrics.requests_throttled.add();
+      return false;
+    }
+    bucket.tokens -= 1;
+    return true;
+  }
 
-    Idx currIdx = INF;
-    TimePoint now = std::chrono::system_clock::now();
-    std::unordered_map<std::string, std::vector<unsigned short>> chash_response_map;
+  RequestShard& requestShard(std::size_t hash){
+    return *request_shards[hash % request_shards.size()];
+  }
 
-    while (true) {
-      chash_q_mutex.lock();
-      while(!chash_queue.empty()){
-        const chash_response res = chash_queue.front();
+  template<typename Pending, typename Key>
+  void queueRequest(Pending RequestShard::*pending, const Key& key, unsigned short port){
+    auto& shard = requestShard(std::hash<Key>{}(key));
+    std::unique_lock coalesce_lock(shard.coalesce_mutex);
+    auto& ports = (shard.*pending)[key];
+    if(!ports.empty()){
+      node_metrics.requests_coalesced.add();
+    }
+    ports.insert(port);
+    coalesce_lock.unlock();
+    shard.coalesce_cv.notify_one();
+  }
 
-        if(currIdx == INF){
-          currIdx = res.idx;
-          now = std::chrono::system_clock::now();
-          chash_response_map.clear();
-        }
+  // Answers a shard's pending requests in rounds. A round waits
+  // COALESCE_WINDOW after the first request so duplicates from other peers
+  // join it, then looks every answer up under one shared lock and sends each
+  // once to all askers.
+  void respondToRequests(RequestShard& shard){
+    using ChashResponse = std::tuple<Idx, Idx, std::string>;
+    using DataResponse = std::pair<Idx, std::pair<BlockHeader, BodyRef>>;
+    while(running){
+      std::unique_lock coalesce_lock(shard.coalesce_mutex);
+      shard.coalesce_cv.wait(coalesce_lock, [this, &shard](){ return !running || !shard.pending_chash.empty() || !shard.pending_data.empty(); });
+      shard.coalesce_cv.wait_for(coalesce_lock, COALESCE_WINDOW, [this](){ return !running; });
+      auto chash_requests = std::exchange(shard.pending_chash, {});
+      auto data_requests = std::exchange(shard.pending_data, {});
+      coalesce_lock.unlock();
 
-        if(currIdx != res.idx){
-          chash_queue.pop();
-          continue;
-        }
-
-        if(auto c_it = chash_response_map.find(res.chash); c_it == chash_response_map.end()){
-          chash_response_map.emplace(res.chash, std::vector{res.port});
+      std::vector<std::pair<ChashResponse, std::unordered_set<unsigned short>>> chash_responses;
+      std::vector<std::pair<DataResponse, std::unordered_set<unsigned short>>> data_responses;
+      {
+        std::shared_lock bchain_lock(bchain_mutex);
+        const auto length = bchain.getLength();
+        for(auto& [index, ports] : chash_requests){
+          if(index < length){
+            chash_responses.emplace_back(ChashResponse{index, length, bchain.getChash(index)}, std::move(ports));
+          }
         }
-        else{
-          c_it->second.push_back(res.port);
+        for(auto& [chash, ports] : data_requests){
+          if(const auto found = bchain.findChash(chash)){
+            data_responses.emplace_back(DataResponse{*found, bchain.getBlockRef(*found)}, std::move(ports));
+          }
         }
-        chash_queue.pop();
       }
-      chash_q_mutex.unlock();
 
-      if(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - now).count() > 250){
-        if(currIdx != INF){
-          sendDataRequestFromChashResponse(currIdx, chash_response_map);
-          now = std::chrono::system_clock::now();
-          currIdx = INF;
-        }
+      for(const auto& [response, ports] : chash_responses){
+        sendMultiple(ports, [this, &response = response](auto& buffer){
+          const auto& [index, length, chash] = response;
+          return encoder.encodeResponseHashMsg(buffer, s_port, r_port, index, length, chash);
+        });
+      }
+      for(const auto& [response, ports] : data_responses){
+        sendMultiple(ports, [this, &response = response](auto& buffer){
+          const auto& [index, block] = response;
+          const auto& [header, body] = block;
+          return encoder.encodeResponseDataMsg(buffer, s_port, r_port, index, header.get_nonce(), header.get_timestamp(), header.get_difficulty(), header.phash_view(), header.chash_view(), *body);
+        });
       }
+    }
+  }
 
-      if(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - now).count() > 350 && currIdx == INF){
-        now = std::chrono::system_clock::now();
-        sendChashRequest(0);
+  // Sync runs as tasks on sync_loop, woken only by replies and timers.
+  // Votes on many indices and searches with many peers proceed at once.
+  void runSynchronizer(){
+    syncRounds();
+    sync_loop.run();
+  }
+
+  // Opens a digest round once SYNC_IDLE passed without a vote
+  Task syncRounds(){
+    while(running){
+      const auto idle = last_sync + SYNC_IDLE - EventLoop::Clock::now();
+      if(!votes.empty() || idle > EventLoop::Clock::duration::zero()){
+        co_await sync_loop.sleep(votes.empty() ? idle : EventLoop::Clock::duration(SYNC_IDLE));
+        continue;
       }
+      last_sync = EventLoop::Clock::now();
+      try{
+        sendDigestRequest(getLength());
+      }
+      catch(SocketException &exp){
+        err("digest request failed : " << exp.what());
+      }
+    }
+  }
+
+  void countVote(const chash_response& res){
+    node_metrics.chash_queue_depth.set(sync_loop.pending());
+    auto [v_it, opened] = votes.try_emplace(res.idx);
+    auto& vote = v_it->second;
+    if(opened) vote.quorum = getPeers().size();
+    vote.chashes[res.chash].push_back(res.port);
+    vote.peer_lengths[res.port] = res.length;
+    if(vote.peer_lengths.size() >= vote.quorum) vote.closed->complete(true);
+    if(opened) runVote(res.idx);
+  }
 
+  Task runVote(Idx idx){
+    const auto opened = EventLoop::Clock::now();
+    co_await sync_loop.wait(votes.at(idx).closed, VOTE_WINDOW);
+    const auto v_it = votes.find(idx);
+    const auto vote = std::move(v_it->second);
+    votes.erase(v_it);
+    if(!running) co_return;
+    last_sync = EventLoop::Clock::now();
+    node_metrics.vote_window_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(last_sync - opened).count());
+    try{
+      sendDataRequestFromChashResponse(idx, vote.chashes, vote.peer_lengths);
+    }
+    catch(SocketException &exp){
+      err("data request for " << idx << " failed : " << exp.what());
     }
+  }
+
+  // Hands a digest to the search that probed for it, or starts a search
+  void routeDigest(const digest_response& res){
+    const auto p_it = digest_probes.find(res.port);
+    if(p_it == digest_probes.end()){
+      searchDivergence(res);
+      return;
+    }
+    if(p_it->second.first != res.length) return; // stale reply
+    const auto reply = std::move(p_it->second.second);
+    digest_probes.erase(p_it);
+    reply->complete(res);
+  }
+
+  // Whether a peer's digest matches ours over the same prefix, nullopt if we are shorter
+  std::optional<bool> agreesWith(const digest_response& res){
+    std::shared_lock bchain_lock(bchain_mutex);
+    if(res.length > bchain.getLength()) return std::nullopt;
+    return bchain.prefixDigest(res.length) == res.digest;
+  }
+
+  // Binary search for the first block where a peer's chain and ours differ.
+  // Each round opens with the digest of our whole chain, peers that agree
+  // are done in one exchange and the others in O(log n) more.
+  Task searchDivergence(digest_response res){
+    const auto port = res.port;
+    const auto agree = agreesWith(res);
+    if(!agree) co_return;
+    if(*agree){
+      // Peer has our chain, or the same prefix followed by more blocks
+      if(res.chainLength > res.length) fetchFrom(port, res.length, res.chainLength);
+      co_return;
+    }
+    // The first block that differs lies in [lo, hi)
+    Idx lo = 0, hi = res.length;
+    while(hi - lo > 1){
+      const auto probe = lo + (hi - lo) / 2;
+      auto reply = std::make_shared<Reply<digest_response>>();
+      digest_probes[port] = {probe, reply};
+      try{
+        sendDigestRequest(probe, port);
+      }
+      catch(SocketException &exp){
+        err("digest probe to " << port << " failed : " << exp.what());
+        digest_probes.erase(port);
+        co_return;
+      }
+      const auto next = co_await sync_loop.wait(reply, DIGEST_TIMEOUT);
+      if(!next || !running){
+        digest_probes.erase(port);
+        co_return;
+      }
+      const auto probe_agrees = agreesWith(*next);
+      if(!probe_agrees) co_return;
+      (*probe_agrees ? lo : hi) = probe;
+      res = *next;
+    }
+    dmsg("diverged from " << port << " at " << lo);
+    if(res.chainLength > lo) fetchFrom(port, lo, res.chainLength);
+  }
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  // Pulls a peer's blocks [from, to) we do not share, streamed when there are many
+  void fetchFrom(unsigned short port, Idx from, Idx to){
+    if(to - from > BULK_SYNC_THRESHOLD){
+      startBulkSync(port, from, to);
+    }
+    else{
+      sendChashRequest(from);
+    }
+  }
 
+  // Streams on the pool so the sync loop keeps running, one stream at a time
+  void startBulkSync(unsigned short port, Idx from, Idx to){
+    if(bulk_syncing.exchange(true)) return;
+    pool.submit([this, port, from, to](){
+      bulkSync(port, from, to);
+      bulk_syncing = false;
+    });
   }
 
-  void sendDataRequestFromChashResponse(const auto& currIdx, const auto& chash_response_map){
+  void sendDataRequestFromChashResponse(const auto& currIdx, const auto& chash_response_map, const auto& peer_lengths){
     unsigned int max = 0;
     std::string chash;
     unsigned short port = 0;
@@ -304,7 +1001,276 @@ private:
         chash = p.first;
       }
     }
-    sendDataRequest(currIdx, chash, port);
+    std::shared_lock bchain_lock(bchain_mutex);
+    const auto length = bchain.getLength();
+    const auto found = bchain.findChash(chash);
+    // Every competing block we lack is fetched, fork choice picks between them
+    std::vector<std::pair<std::string, unsigned short>> missing;
+    for(const auto& p: chash_response_map){
+      if(!bchain.contains(p.first)){
+        missing.emplace_back(p.first, p.second.front());
+      }
+    }
+    bchain_lock.unlock();
+
+    // Same hash at the same index means no fork here, only later blocks may differ
+    const bool known = found && *found == currIdx;
+    const Idx from = known ? currIdx + 1 : currIdx;
+
+    if(const auto l_it = peer_lengths.find(port); l_it != peer_lengths.end()){
+      if(l_it->second > length + BULK_SYNC_THRESHOLD){
+        startBulkSync(port, from, l_it->second);
+        return;
+      }
+    }
+    if(missing.empty()){
+      sendChashRequest(currIdx + 1);
+      return;
+    }
+    for(const auto& [missingHash, missingPort] : missing){
+      sendDataRequest(currIdx, missingHash, missingPort);
+    }
+  }
+
+  // Serves every connection on its own thread, so a slow or silent peer
+  // only holds up its own stream
+  void serveBulkSync(){
+    while(true){
+      std::unique_ptr<TCPSocket> conn;
+      try{
+        conn.reset(bulk_sock->accept());
+      }
+      catch(SocketException &exp){
+        if(running){
+          err("bulk sync accept failed : " << exp.what());
+        }
+        break;
+      }
+      try{
+        conn->setRecvTimeout(BULK_SYNC_TIMEOUT);
+      }
+      catch(SocketException &exp){
+        err("bulk sync connection failed : " << exp.what());
+        continue;
+      }
+      std::scoped_lock bulk_lock(bulk_mutex);
+      reapBulkConnections();
+      auto& connection = bulk_connections.emplace_back();
+      connection.conn = std::move(conn);
+      connection.thread = std::thread([this, &connection](){
+        try{
+          handleBulkSyncConnection(*connection.conn);
+        }
+        catch(SocketException &exp){
+          err("bulk sync connection failed : " << exp.what());
+        }
+        std::scoped_lock bulk_lock(bulk_mutex);
+        connection.done = true;
+      });
+    }
+  }
+
+  // Joins and closes ended connections. Needs bulk_mutex.
+  void reapBulkConnections(){
+    for(auto c_it = bulk_connections.begin(); c_it != bulk_connections.end();){
+      if(c_it->done){
+        c_it->thread.join();
+        c_it = bulk_connections.erase(c_it);
+      }
+      else{
+        ++c_it;
+      }
+    }
+  }
+
+  void handleBulkSyncConnection(TCPSocket& conn){
+    char frame[BUFFER_SIZE];
+    std::vector<char> frames(BULK_SYNC_CHUNK * sizeof(ResponseBodyMessage));
+    std::vector<std::pair<BlockHeader, BodyDigest>> headers;
+    headers.reserve(BULK_SYNC_CHUNK);
+    int bodiesLen = 0;
+    auto flushBodies = [&](){
+      if(bodiesLen == 0) return;
+      conn.send(frames.data(), bodiesLen, MSG_NOSIGNAL);
+      countSent(MessageType::ResponseBodyMsg, bodiesLen / sizeof(ResponseBodyMessage), bodiesLen);
+      bodiesLen = 0;
+    };
+    while(recvFrame(conn, frame)){
+      switch(decoder.decodeMessageType(frame)){
+
+        case MessageType::BulkSyncRequestMsg:{
+          auto [index, to] = decoder.decodeBulkSyncRequestMsg(frame);
+          while(true){
+            int framesLen = 0;
+            headers.clear();
+            {
+              std::shared_lock bchain_lock(bchain_mutex);
+              to = std::min<Idx>(to, bchain.getLength());
+              for(const auto end = std::min<Idx>(to, index + BULK_SYNC_CHUNK); index < end; ++index){
+                headers.push_back(bchain.getHeader(index));
+              }
+            }
+            for(const auto& [header, body] : headers){
+              char *buffer = frames.data() + framesLen;
+              framesLen += encoder.encodeResponseHeaderMsg(buffer, s_port, r_port, header.get_index(), header.get_nonce(), header.get_timestamp(), header.get_difficulty(), header.phash_view(), header.chash_view(), body);
+            }
+            if(framesLen == 0) break;
+            conn.send(frames.data(), framesLen, MSG_NOSIGNAL);
+            countSent(MessageType::ResponseHeaderMsg, framesLen / sizeof(ResponseHeaderMessage), framesLen);
+          }
+          int frameLen = encoder.encodeBulkSyncEndMsg(frame, s_port, r_port, index);
+          conn.send(frame, frameLen, MSG_NOSIGNAL);
+          break;
+        }
+
+        case MessageType::RequestBodyMsg:{
+          const auto digest = decoder.decodeRequestBodyMsg(frame);
+          const auto body = [this, &digest](){
+            std::shared_lock bchain_lock(bchain_mutex);
+            return bchain.findBody(digest);
+          }();
+          // Unknown bodies are skipped, the receiver finds them missing at the end marker
+          if(!body) break;
+          char *buffer = frames.data() + bodiesLen;
+          bodiesLen += encoder.encodeResponseBodyMsg(buffer, s_port, r_port, digest, *body);
+          if(bodiesLen + sizeof(ResponseBodyMessage) > frames.size()) flushBodies();
+          break;
+        }
+
+        case MessageType::BulkSyncEndMsg:{
+          flushBodies();
+          const int frameLen = encoder.encodeBulkSyncEndMsg(frame, s_port, r_port, decoder.decodeBulkSyncEndMsg(frame));
+          conn.send(frame, frameLen, MSG_NOSIGNAL);
+          break;
+        }
+
+        default:
+          err("unexpected bulk sync frame");
+          return;
+      }
+    }
+  }
+
+  // Pulls blocks [from, to) in windows of BULK_SYNC_WINDOW. Each window
+  // streams headers first, then only the bodies we hold under no block yet,
+  // each distinct one once however many blocks share it.
+  void bulkSync(unsigned short port, Idx from, Idx to){
+    dmsg("bulk sync [" << from << ", " << to << ") from " << port);
+    try{
+      TCPSocket conn(IP_ADDR, port);
+      conn.setRecvTimeout(BULK_SYNC_TIMEOUT);
+      char frame[BUFFER_SIZE];
+      std::vector<header_response> headers;
+      std::unordered_map<BodyDigest, BodyRef, BodyDigestHash> bodies;
+      std::vector<char> requests;
+      std::vector<data_response> batch;
+      while(from < to){
+        int frameLen = encoder.encodeBulkSyncRequestMsg(frame, s_port, r_port, from, std::min<Idx>(to, from + BULK_SYNC_WINDOW));
+        conn.send(frame, frameLen, MSG_NOSIGNAL);
+        headers.clear();
+        Idx next = from;
+        if(!recvBulkFrames(conn, port, MessageType::ResponseHeaderMsg, [this, &headers](const char *f){
+          headers.push_back(decoder.decodeResponseHeaderMsg(f));
+        }, &next)) return;
+
+        bodies.clear();
+        requests.clear();
+        {
+          std::shared_lock bchain_lock(bchain_mutex);
+          for(const auto& header : headers){
+            if(bodies.count(header.body)) continue;
+            auto body = bchain.findBody(header.body);
+            if(!body){
+              requests.resize(requests.size() + sizeof(RequestBodyMessage));
+              char *buffer = requests.data() + requests.size() - sizeof(RequestBodyMessage);
+              encoder.encodeRequestBodyMsg(buffer, s_port, r_port, header.body);
+            }
+            bodies.emplace(header.body, std::move(body));
+          }
+        }
+        node_metrics.bodies_skipped.add(headers.size() - requests.size() / sizeof(RequestBodyMessage));
+        requests.resize(requests.size() + sizeof(BulkSyncEndMessage));
+        char *end = requests.data() + requests.size() - sizeof(BulkSyncEndMessage);
+        encoder.encodeBulkSyncEndMsg(end, s_port, r_port, next);
+        conn.send(requests.data(), requests.size(), MSG_NOSIGNAL);
+        countSent(MessageType::RequestBodyMsg, requests.size() / sizeof(RequestBodyMessage), requests.size() - sizeof(BulkSyncEndMessage));
+        if(!recvBulkFrames(conn, port, MessageType::ResponseBodyMsg, [this, &bodies](const char *f){
+          auto [digest, data] = decoder.decodeResponseBodyMsg(f);
+          const auto b_it = bodies.find(digest);
+          if(b_it != bodies.end() && bodyDigest(data) == digest){
+            b_it->second = std::make_shared<const std::string>(std::move(data));
+          }
+        }, nullptr)) return;
+
+        // Blocks before a missing or corrupt body still connect, nothing past
+        // it is applied and the next probe resumes the sync from the gap
+        for(const auto& header : headers){
+          const auto& body = bodies.at(header.body);
+          if(!body){
+            err("bulk sync from " << port << " is missing the body of block " << header.idx);
+            applyBlocks(batch);
+            return;
+          }
+          batch.push_back(data_response{header.idx, port, header.nonce, header.timestamp, header.difficulty, header.phash, header.chash, *body});
+          if(batch.size() == BULK_SYNC_CHUNK){
+            applyBlocks(batch);
+          }
+        }
+        applyBlocks(batch);
+        if(next <= from) to = from; // peer has nothing more
+        from = next;
+      }
+    }
+    catch(SocketException &exp){
+      err("bulk sync from " << port << " failed : " << exp.what());
+    }
+  }
+
+  // Hands frames of type to on_frame until a BulkSyncEndMsg, storing its next
+  bool recvBulkFrames(TCPSocket& conn, unsigned short port, MessageType type, auto&& on_frame, Idx *next){
+    char frame[BUFFER_SIZE];
+    while(true){
+      if(!recvFrame(conn, frame)){
+        err("bulk sync stream from " << port << " closed early");
+        return false;
+      }
+      const auto msgType = decoder.decodeMessageType(frame);
+      if(msgType == MessageType::BulkSyncEndMsg){
+        if(next) *next = decoder.decodeBulkSyncEndMsg(frame);
+        return true;
+      }
+      if(msgType != type){
+        err("unexpected bulk sync frame from " << port);
+        return false;
+      }
+      countRecv(type, 1, ((MessageHeader *)frame)->packetSize);
+      on_frame(frame);
+    }
+  }
+
+  void applyBlocks(auto& batch){
+    std::scoped_lock bchain_lock(bchain_mutex);
+    for(const auto& res : batch){
+      if(const auto changed = bchain.updateBlock(res.idx, res.nonce, res.phash, res.chash, res.data, res.timestamp, res.difficulty)){
+        notifyBlocks(*changed);
+        cancelStaleMining(bchain.getLength() - 1);
+      }
+    }
+    batch.clear();
+  }
+
+  // Reads one length-prefixed frame (MessageHeader.packetSize) from a TCP stream
+  bool recvFrame(TCPSocket& conn, char *frame){
+    constexpr int headerSize = sizeof(MessageHeader);
+    if(conn.recv(frame, headerSize, MSG_WAITALL) != headerSize){
+      return false;
+    }
+    const auto* const header = (MessageHeader *)(frame);
+    if(header->packetSize < headerSize || header->packetSize > BUFFER_SIZE){
+      return false;
+    }
+    const int bodySize = header->packetSize - headerSize;
+    return bodySize == 0 || conn.recv(frame + headerSize, bodySize, MSG_WAITALL) == bodySize;
   }
 
 };
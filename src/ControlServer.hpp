@@ -0,0 +1,330 @@
+#ifndef __CONTROL_SERVER_HPP__
+#define __CONTROL_SERVER_HPP__
+
+#include <list>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <memory>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <functional>
+#include <unordered_set>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "ClientHandler.hpp"
+#include "log.h"
+
+// Replies a session may owe before it stops reading commands
+static constexpr auto CONTROL_MAX_PENDING = 1024 * 8;
+static constexpr auto CONTROL_BACKLOG = 16;
+static constexpr auto CONTROL_READ_SIZE = 1024 * 64;
+
+// Line protocol for scripted clients, one command per line:
+//   add <data>           -> ok <idx>
+//   update <idx> <data>  -> ok
+//   get <idx>            -> ok <nonce> <phash> <chash> <data>
+//   len                  -> ok <length>
+//   find <words>         -> ok <idx>...     blocks holding every word, word* as a prefix
+//   verify               -> ok valid | ok invalid
+//   export <path>        -> ok <blocks>     snapshot to a file
+//   import <path>        -> ok <length>     adopt a snapshot file
+// Commands are submitted as soon as they are read and replies are written in
+// command order, failures as "err <reason>". Queries are answered after the
+// replies before them, so they see at least the effect of earlier commands.
+class ControlSession {
+
+  using Reply = std::function<std::string()>;
+
+private:
+
+  ClientHandler& client;
+  int in_fd;
+  int out_fd;
+
+  std::mutex replies_mutex;
+  std::condition_variable replies_cv;
+  std::deque<Reply> replies;
+  bool closed = false;
+
+public:
+
+  ControlSession(ClientHandler& _client, int _in_fd, int _out_fd) : client(_client), in_fd(_in_fd), out_fd(_out_fd) {}
+
+  // Returns once in_fd reaches EOF and every reply has been written
+  void run(){
+    std::thread writer([this](){ writeReplies(); });
+    readCommands();
+    {
+      std::scoped_lock replies_lock(replies_mutex);
+      closed = true;
+    }
+    replies_cv.notify_all();
+    writer.join();
+  }
+
+private:
+
+  void readCommands(){
+    std::string pending;
+    std::vector<char> buffer(CONTROL_READ_SIZE);
+    while(true){
+      const auto n = ::read(in_fd, buffer.data(), buffer.size());
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) break;
+      pending.append(buffer.data(), n);
+      std::size_t start = 0;
+      for(auto end = pending.find('\n'); end != std::string::npos; end = pending.find('\n', start)){
+        auto line = pending.substr(start, end - start);
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        if(!line.empty()) queue(dispatch(line));
+        start = end + 1;
+      }
+      pending.erase(0, start);
+    }
+    if(!pending.empty()) queue(dispatch(pending));
+  }
+
+  void queue(Reply reply){
+    std::unique_lock replies_lock(replies_mutex);
+    replies_cv.wait(replies_lock, [this](){ return replies.size() < CONTROL_MAX_PENDING; });
+    replies.push_back(std::move(reply));
+    replies_lock.unlock();
+    replies_cv.notify_all();
+  }
+
+  Reply dispatch(const std::string& line){
+    std::istringstream args(line);
+    std::string cmd;
+    args >> cmd;
+    if(cmd == "add"){
+      const auto data = line.size() > 4 ? line.substr(4) : std::string();
+      auto idx = std::make_shared<std::future<Idx>>(client.addData(data));
+      return [idx](){ return "ok " + std::to_string(idx->get()); };
+    }
+    if(cmd == "update"){
+      Idx idx;
+      if(!(args >> idx)) return reject("usage: update <idx> <data>");
+      args.get();
+      std::string data;
+      std::getline(args, data);
+      // Applied in order, so it can target a block added earlier in the stream
+      return [this, idx, data](){ client.updateData(idx, data).get(); return std::string("ok"); };
+    }
+    if(cmd == "get"){
+      Idx idx;
+      if(!(args >> idx)) return reject("usage: get <idx>");
+      return [this, idx](){
+        const auto block = client.getBlock(idx);
+        if(!block) throw std::out_of_range("no block " + std::to_string(idx));
+        const auto& [nonce, phash, chash, data] = *block;
+        return "ok " + std::to_string(nonce) + " " + phash + " " + chash + " " + data.substr(0, data.find('\0'));
+      };
+    }
+    if(cmd == "find"){
+      const auto query = line.size() > 5 ? line.substr(5) : std::string();
+      return [this, query](){
+        std::string reply = "ok";
+        for(const auto idx : client.findData(query)){
+          reply += " " + std::to_string(idx);
+        }
+        return reply;
+      };
+    }
+    if(cmd == "len"){
+      return [this](){ return "ok " + std::to_string(client.getLength()); };
+    }
+    if(cmd == "verify"){
+      return [this](){ return std::string(client.verifyChain() ? "ok valid" : "ok invalid"); };
+    }
+    if(cmd == "export" || cmd == "import"){
+      const auto path = line.size() > 7 ? line.substr(7) : std::string();
+      return [this, cmd, path](){
+        if(cmd == "export"){
+          std::ofstream file(path, std::ios::binary);
+          if(!file) throw std::runtime_error("cannot open " + path);
+          return "ok " + std::to_string(client.exportSnapshot(file));
+        }
+        std::ifstream file(path, std::ios::binary);
+        if(!file) throw std::runtime_error("cannot open " + path);
+        return "ok " + std::to_string(client.importSnapshot(file));
+      };
+    }
+    return reject("unknown command " + cmd);
+  }
+
+  static Reply reject(const std::string& reason){
+    return [reason]() -> std::string { throw std::invalid_argument(reason); };
+  }
+
+  // Replies are batched into one write while more are already queued
+  void writeReplies(){
+    std::string out;
+    bool writable = true;
+    while(true){
+      std::unique_lock replies_lock(replies_mutex);
+      if(replies.empty() && !out.empty()){
+        replies_lock.unlock();
+        writable = writable && writeAll(out);
+        out.clear();
+        continue;
+      }
+      replies_cv.wait(replies_lock, [this](){ return !replies.empty() || closed; });
+      if(replies.empty()) break;
+      auto reply = std::move(replies.front());
+      replies.pop_front();
+      replies_lock.unlock();
+      replies_cv.notify_all();
+
+      try{
+        out += reply();
+      }
+      catch(const std::exception& exp){
+        out += std::string("err ") + exp.what();
+      }
+      out += "\n";
+      if(out.size() >= CONTROL_READ_SIZE){
+        writable = writable && writeAll(out);
+        out.clear();
+      }
+    }
+  }
+
+  bool writeAll(const std::string& out){
+    for(std::size_t sent = 0; sent < out.size();){
+      const auto n = ::write(out_fd, out.data() + sent, out.size() - sent);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0){
+        err("control reply write failed : " << std::strerror(errno));
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+
+};
+
+// Accepts control sessions on a Unix-domain socket
+class ControlServer {
+
+private:
+
+  ClientHandler& client;
+  std::string path;
+  int listen_fd = -1;
+  std::thread acceptor;
+
+  std::mutex sessions_mutex;
+  struct Session {
+    std::thread thread;
+    // Set under sessions_mutex as the session ends, its thread is then joined on the next accept
+    bool done = false;
+  };
+  std::list<Session> sessions;
+  std::unordered_set<int> session_fds;
+
+public:
+
+  explicit ControlServer(ClientHandler& _client) : client(_client) {}
+
+  ~ControlServer(){
+    stop();
+  }
+
+  // Serves a single session, e.g. on stdin and stdout
+  void serve(int in_fd, int out_fd){
+    ControlSession(client, in_fd, out_fd).run();
+  }
+
+  void listen(const std::string& _path){
+    sockaddr_un addr{};
+    if(_path.size() >= sizeof(addr.sun_path)){
+      throw std::invalid_argument("control socket path too long");
+    }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, _path.c_str());
+
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+      throw std::runtime_error(std::string("control socket : ") + std::strerror(errno));
+    }
+    ::unlink(_path.c_str());
+    if(::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, CONTROL_BACKLOG) < 0){
+      const auto reason = std::string("control socket ") + _path + " : " + std::strerror(errno);
+      ::close(fd);
+      throw std::runtime_error(reason);
+    }
+    path = _path;
+    listen_fd = fd;
+    acceptor = std::thread([this](){ accept(); });
+    dmsg("control socket : " << path);
+  }
+
+  // Closes the listening socket, ends open sessions once their replies are out
+  void stop(){
+    if(listen_fd < 0) return;
+    ::shutdown(listen_fd, SHUT_RDWR);
+    acceptor.join();
+    ::close(listen_fd);
+    ::unlink(path.c_str());
+    listen_fd = -1;
+
+    std::unique_lock sessions_lock(sessions_mutex);
+    for(auto fd : session_fds){
+      ::shutdown(fd, SHUT_RD);
+    }
+    auto finished = std::move(sessions);
+    sessions_lock.unlock();
+    for(auto& session : finished){
+      session.thread.join();
+    }
+  }
+
+private:
+
+  void accept(){
+    while(true){
+      const int fd = ::accept(listen_fd, nullptr, nullptr);
+      if(fd < 0){
+        if(errno == EINTR || errno == ECONNABORTED) continue;
+        break;
+      }
+      std::scoped_lock sessions_lock(sessions_mutex);
+      reapSessions();
+      session_fds.insert(fd);
+      auto& session = sessions.emplace_back();
+      session.thread = std::thread([this, fd, &session](){
+        ControlSession(client, fd, fd).run();
+        std::scoped_lock sessions_lock(sessions_mutex);
+        session_fds.erase(fd);
+        ::close(fd);
+        session.done = true;
+      });
+    }
+  }
+
+  // Joins ended sessions, so a daemon serving many short connections keeps
+  // only the live ones. Needs sessions_mutex.
+  void reapSessions(){
+    for(auto s_it = sessions.begin(); s_it != sessions.end();){
+      if(s_it->done){
+        s_it->thread.join();
+        s_it = sessions.erase(s_it);
+      }
+      else{
+        ++s_it;
+      }
+    }
+  }
+
+};
+
+#endif
@@ -46,7 +46,7 @@ public:
     return msgSize;
   }
 
-  int encodeResponseHashMsg(auto& buffer, auto s_port_no, auto r_port_no, auto index, auto hash){
+  int encodeResponseHashMsg(auto& buffer, auto s_port_no, auto r_port_no, auto index, auto length, auto hash){
     ResponseChashMessage msg;
     int msgSize = sizeof(ResponseChashMessage);
     msg.header.packetSize = msgSize;
@@ -54,13 +54,14 @@ public:
     msg.header.senderPort = s_port_no;
     msg.header.receivePort = r_port_no;
     msg.idx = index;
+    msg.length = length;
     hash.copy(msg.chash, HASH_SIZE);
     std::memcpy(buffer, &msg, sizeof(ResponseChashMessage));
     return msgSize;
   }
 
-  int encodeResponseDataMsg(auto& buffer, auto s_port_no, auto r_port_no, auto index, auto nonce, const auto& phash, const auto& chash, const auto& data){
-    ResponseDataMessage msg;
+  int encodeResponseDataMsg(auto& buffer, auto s_port_no, auto r_port_no, auto index, auto nonce, auto timestamp, auto difficulty, const auto& phash, const auto& chash, const auto& data){
+    ResponseDataMessage msg{};
     int msgSize = sizeof(ResponseDataMessage);
     msg.header.packetSize = msgSize;
     msg.header.msgType = MessageType::ResponseDataMsg;
@@ -68,6 +69,8 @@ public:
     msg.header.receivePort = r_port_no;
     msg.idx = index;
     msg.nonce = nonce;
+    msg.timestamp = timestamp;
+    msg.difficulty = difficulty;
     phash.copy(msg.phash, HASH_SIZE);
     chash.copy(msg.chash, HASH_SIZE);
     data.copy(msg.data, DATA_SIZE);
@@ -100,6 +103,100 @@ public:
     return msgSize;
   }
 
+  int encodeBulkSyncRequestMsg(auto& buffer, auto s_port_no, auto r_port_no, auto from, auto to){
+    BulkSyncRequestMessage msg;
+    int msgSize = sizeof(BulkSyncRequestMessage);
+    msg.header.packetSize = msgSize;
+    msg.header.msgType = MessageType::BulkSyncRequestMsg;
+    msg.header.senderPort = s_port_no;
+    msg.header.receivePort = r_port_no;
+    msg.from = from;
+    msg.to = to;
+    std::memcpy(buffer, &msg, sizeof(BulkSyncRequestMessage));
+    return msgSize;
+  }
+
+  int encodeBulkSyncEndMsg(auto& buffer, auto s_port_no, auto r_port_no, auto next){
+    BulkSyncEndMessage msg;
+    int msgSize = sizeof(BulkSyncEndMessage);
+    msg.header.packetSize = msgSize;
+    msg.header.msgType = MessageType::BulkSyncEndMsg;
+    msg.header.senderPort = s_port_no;
+    msg.header.receivePort = r_port_no;
+    msg.next = next;
+    std::memcpy(buffer, &msg, sizeof(BulkSyncEndMessage));
+    return msgSize;
+  }
+
+  int encodeRequestDigestMsg(auto& buffer, auto s_port_no, auto r_port_no, auto length){
+    RequestDigestMessage msg;
+    int msgSize = sizeof(RequestDigestMessage);
+    msg.header.packetSize = msgSize;
+    msg.header.msgType = MessageType::RequestDigestMsg;
+    msg.header.senderPort = s_port_no;
+    msg.header.receivePort = r_port_no;
+    msg.length = length;
+    std::memcpy(buffer, &msg, sizeof(RequestDigestMessage));
+    return msgSize;
+  }
+
+  int encodeResponseDigestMsg(auto& buffer, auto s_port_no, auto r_port_no, auto length, auto chainLength, const auto& digest){
+    ResponseDigestMessage msg;
+    int msgSize = sizeof(ResponseDigestMessage);
+    msg.header.packetSize = msgSize;
+    msg.header.msgType = MessageType::ResponseDigestMsg;
+    msg.header.senderPort = s_port_no;
+    msg.header.receivePort = r_port_no;
+    msg.length = length;
+    msg.chainLength = chainLength;
+    digest.copy(msg.digest, DIGEST_SIZE);
+    std::memcpy(buffer, &msg, sizeof(ResponseDigestMessage));
+    return msgSize;
+  }
+
+  int encodeResponseHeaderMsg(auto& buffer, auto s_port_no, auto r_port_no, auto index, auto nonce, auto timestamp, auto difficulty, const auto& phash, const auto& chash, const BodyDigest& body){
+    ResponseHeaderMessage msg;
+    int msgSize = sizeof(ResponseHeaderMessage);
+    msg.header.packetSize = msgSize;
+    msg.header.msgType = MessageType::ResponseHeaderMsg;
+    msg.header.senderPort = s_port_no;
+    msg.header.receivePort = r_port_no;
+    msg.idx = index;
+    msg.nonce = nonce;
+    msg.timestamp = timestamp;
+    msg.difficulty = difficulty;
+    phash.copy(msg.phash, HASH_SIZE);
+    chash.copy(msg.chash, HASH_SIZE);
+    std::memcpy(msg.body, body.data(), DIGEST_SIZE);
+    std::memcpy(buffer, &msg, sizeof(ResponseHeaderMessage));
+    return msgSize;
+  }
+
+  int encodeRequestBodyMsg(auto& buffer, auto s_port_no, auto r_port_no, const BodyDigest& digest){
+    RequestBodyMessage msg;
+    int msgSize = sizeof(RequestBodyMessage);
+    msg.header.packetSize = msgSize;
+    msg.header.msgType = MessageType::RequestBodyMsg;
+    msg.header.senderPort = s_port_no;
+    msg.header.receivePort = r_port_no;
+    std::memcpy(msg.digest, digest.data(), DIGEST_SIZE);
+    std::memcpy(buffer, &msg, sizeof(RequestBodyMessage));
+    return msgSize;
+  }
+
+  int encodeResponseBodyMsg(auto& buffer, auto s_port_no, auto r_port_no, const BodyDigest& digest, const auto& data){
+    ResponseBodyMessage msg{};
+    int msgSize = sizeof(ResponseBodyMessage);
+    msg.header.packetSize = msgSize;
+    msg.header.msgType = MessageType::ResponseBodyMsg;
+    msg.header.senderPort = s_port_no;
+    msg.header.receivePort = r_port_no;
+    std::memcpy(msg.digest, digest.data(), DIGEST_SIZE);
+    data.copy(msg.data, DATA_SIZE);
+    std::memcpy(buffer, &msg, sizeof(ResponseBodyMessage));
+    return msgSize;
+  }
+
   // Decoder
 
   const auto decodeMessageType(const auto& buffer){
@@ -129,17 +226,58 @@ public:
 
   const auto decodeResponseChashMsg(const auto& buffer){
     const auto* const msg = (ResponseChashMessage*) buffer;
-    return chash_response{msg->idx, msg->header.receivePort, std::string(msg->chash)};
+    return chash_response{msg->idx, msg->header.receivePort, msg->length, std::string(msg->chash, HASH_SIZE)};
   }
 
   const auto decodeRequestDataMsg(const auto& buffer){
     const auto* const msg = (RequestDataMessage*) buffer;
-    return std::tuple{msg->idx, msg->header.receivePort};
+    return std::tuple{msg->idx, msg->header.receivePort, std::string(msg->chash, HASH_SIZE)};
   }
 
   const auto decodeResponseDataMsg(const auto& buffer){
     const auto* const msg = (ResponseDataMessage*) buffer;
-    return data_response{msg->idx, msg->header.receivePort, msg->nonce, std::string(msg->phash), std::string(msg->chash), std::string(msg->data)};
+    return data_response{msg->idx, msg->header.receivePort, msg->nonce, msg->timestamp, msg->difficulty, std::string(msg->phash, HASH_SIZE), std::string(msg->chash, HASH_SIZE), std::string(msg->data, DATA_SIZE)};
+  }
+
+  const auto decodeResponseHeaderMsg(const auto& buffer){
+    const auto* const msg = (ResponseHeaderMessage*) buffer;
+    header_response res{msg->idx, msg->nonce, msg->timestamp, msg->difficulty, std::string(msg->phash, HASH_SIZE), std::string(msg->chash, HASH_SIZE), {}};
+    std::memcpy(res.body.data(), msg->body, DIGEST_SIZE);
+    return res;
+  }
+
+  const auto decodeRequestBodyMsg(const auto& buffer){
+    const auto* const msg = (RequestBodyMessage*) buffer;
+    BodyDigest digest;
+    std::memcpy(digest.data(), msg->digest, DIGEST_SIZE);
+    return digest;
+  }
+
+  const auto decodeResponseBodyMsg(const auto& buffer){
+    const auto* const msg = (ResponseBodyMessage*) buffer;
+    BodyDigest digest;
+    std::memcpy(digest.data(), msg->digest, DIGEST_SIZE);
+    return std::pair{digest, std::string(msg->data, strnlen(msg->data, DATA_SIZE))};
+  }
+
+  const auto decodeBulkSyncRequestMsg(const auto& buffer){
+    const auto* const msg = (BulkSyncRequestMessage*) buffer;
+    return std::tuple{msg->from, msg->to};
+  }
+
+  const auto decodeBulkSyncEndMsg(const auto& buffer){
+    const auto* const msg = (BulkSyncEndMessage*) buffer;
+    return msg->next;
+  }
+
+  const auto decodeRequestDigestMsg(const auto& buffer){
+    const auto* const msg = (RequestDigestMessage*) buffer;
+    return std::tuple{msg->length, msg->header.receivePort};
+  }
+
+  const auto decodeResponseDigestMsg(const auto& buffer){
+    const auto* const msg = (ResponseDigestMessage*) buffer;
+    return digest_response{msg->length, msg->header.receivePort, msg->chainLength, std::string(msg->digest, DIGEST_SIZE)};
   }
 
 };
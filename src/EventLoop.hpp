@@ -0,0 +1,183 @@
+#ifndef __EVENT_LOOP_HPP__
+#define __EVENT_LOOP_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "log.h"
+
+// Coroutine that starts right away and is never awaited, its frame is freed
+// when it returns. Each of its suspensions must eventually be resumed by the
+// loop, which EventLoop::run() guarantees on stop by firing every timer.
+// An exception that escapes it is logged and ends only that task.
+struct Task {
+  struct promise_type {
+    Task get_return_object(){ return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void(){}
+    void unhandled_exception(){
+      try{
+        throw;
+      }
+      catch(const std::exception& exp){
+        err("task failed : " << exp.what());
+      }
+      catch(...){
+        err("task failed");
+      }
+    }
+  };
+};
+
+class EventLoop;
+
+// A value one task waits for. Whoever delivers it completes it on the loop
+// thread, or the wait's timeout completes it empty, whichever comes first.
+template<typename T>
+class Reply {
+
+  friend class EventLoop;
+
+private:
+
+  std::optional<T> value;
+  std::coroutine_handle<> waiter;
+  bool done = false;
+
+public:
+
+  bool pending() const {
+    return !done;
+  }
+
+  void complete(std::optional<T> v = std::nullopt){
+    if(std::exchange(done, true)) return;
+    value = std::move(v);
+    if(waiter) std::exchange(waiter, {}).resume();
+  }
+
+};
+
+// Runs sync tasks on a single thread. Other threads hand it work with post(),
+// the loop sleeps until that work arrives or the next timer is due.
+class EventLoop {
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+private:
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::function<void()>> posted;
+  bool stopped = false;
+
+  // Loop thread only
+  std::multimap<Clock::time_point, std::function<void()>> timers;
+
+public:
+
+  // Runs fn on the loop thread, dropped once stopped. Returns how many wait.
+  std::size_t post(std::function<void()> fn){
+    std::unique_lock lock(mutex);
+    if(stopped) return 0;
+    posted.push_back(std::move(fn));
+    const auto depth = posted.size();
+    lock.unlock();
+    cv.notify_one();
+    return depth;
+  }
+
+  std::size_t pending(){
+    std::scoped_lock lock(mutex);
+    return posted.size();
+  }
+
+  // Loop thread only
+  void at(Clock::time_point when, std::function<void()> fn){
+    timers.emplace(when, std::move(fn));
+  }
+
+  void run(){
+    std::unique_lock lock(mutex);
+    while(!stopped){
+      if(posted.empty()){
+        if(timers.empty()) cv.wait(lock);
+        else cv.wait_until(lock, timers.begin()->first);
+      }
+      auto ready = std::exchange(posted, {});
+      lock.unlock();
+      for(auto& fn : ready){
+        fn();
+      }
+      fire(Clock::now());
+      lock.lock();
+    }
+    lock.unlock();
+    // Suspended tasks wake early, see the stop and return
+    while(!timers.empty()){
+      fire(Clock::time_point::max());
+    }
+  }
+
+  void stop(){
+    {
+      std::scoped_lock lock(mutex);
+      stopped = true;
+    }
+    cv.notify_all();
+  }
+
+  // co_await loop.sleep(d)
+  auto sleep(Clock::duration d){
+    struct Sleep {
+      EventLoop& loop;
+      Clock::time_point when;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h){ loop.at(when, [h](){ h.resume(); }); }
+      void await_resume() const noexcept {}
+    };
+    return Sleep{*this, Clock::now() + d};
+  }
+
+  // co_await loop.wait(reply, timeout) yields the value, or nullopt on timeout
+  template<typename T>
+  auto wait(std::shared_ptr<Reply<T>> reply, Clock::duration timeout){
+    struct Wait {
+      EventLoop& loop;
+      std::shared_ptr<Reply<T>> reply;
+      Clock::time_point deadline;
+      bool await_ready() const noexcept { return !reply->pending(); }
+      void await_suspend(std::coroutine_handle<> h){
+        reply->waiter = h;
+        loop.at(deadline, [reply = reply](){ reply->complete(); });
+      }
+      std::optional<T> await_resume(){ return std::move(reply->value); }
+    };
+    return Wait{*this, std::move(reply), Clock::now() + timeout};
+  }
+
+private:
+
+  void fire(Clock::time_point now){
+    while(!timers.empty() && timers.begin()->first <= now){
+      auto fn = std::move(timers.begin()->second);
+      timers.erase(timers.begin());
+      fn();
+    }
+  }
+
+};
+
+#endif
@@ -1,18 +1,109 @@
 #include <iostream>
+#include <fstream>
+#include <cstring>
 #include <signal.h>
 
 #include "ClientHandler.hpp"
-
-ClientHandler c;
+#include "ControlServer.hpp"
 
 int main(int argc, char const *argv[]) {
 
+  std::string metricsFile;
+  std::string controlPath;
+  std::string snapshotPath;
+  std::string bodyFile;
+  BodyStore::Limits pruning;
+  int metricsInterval = 1000;
+  unsigned listeners = 1;
+  TransportKind transport = TransportKind::Socket;
+  bool daemon = false;
+  // Malformed values, e.g. a non-numeric count or an unknown log level, stop the node
+  try{
+    for(int i = 1; i < argc; i++){
+      if(std::strcmp(argv[i], "--daemon") == 0) daemon = true;
+      else if(i + 1 == argc) break;
+      else if(std::strcmp(argv[i], "--metrics-file") == 0) metricsFile = argv[++i];
+      else if(std::strcmp(argv[i], "--metrics-interval") == 0) metricsInterval = std::stoi(argv[++i]);
+      else if(std::strcmp(argv[i], "--log-level") == 0) Logger::setLevel(Logger::parseLevel(argv[++i]));
+      else if(std::strcmp(argv[i], "--control") == 0) controlPath = argv[++i];
+      else if(std::strcmp(argv[i], "--load-snapshot") == 0) snapshotPath = argv[++i];
+      else if(std::strcmp(argv[i], "--prune-blocks") == 0) pruning.max_blocks = std::stoull(argv[++i]);
+      else if(std::strcmp(argv[i], "--prune-bytes") == 0) pruning.max_bytes = std::stoull(argv[++i]);
+      else if(std::strcmp(argv[i], "--body-file") == 0) bodyFile = argv[++i];
+      else if(std::strcmp(argv[i], "--listeners") == 0) listeners = std::stoul(argv[++i]);
+      else if(std::strcmp(argv[i], "--transport") == 0) transport = std::strcmp(argv[++i], "uring") == 0 ? TransportKind::IoUring : TransportKind::Socket;
+    }
+  }
+  catch(const std::exception& exp){
+    err("bad argument : " << exp.what());
+    return 1;
+  }
+  ClientHandler c(listeners, transport);
+  try{
+    c.setPruning(pruning, bodyFile);
+  }
+  catch(const std::exception& exp){
+    err(exp.what());
+    return 1;
+  }
+  if(!snapshotPath.empty()){
+    try{
+      std::ifstream file(snapshotPath, std::ios::binary);
+      c.importSnapshot(file);
+    }
+    catch(const std::exception& exp){
+      err("loading snapshot " << snapshotPath << " failed : " << exp.what());
+      return 1;
+    }
+  }
+  if(!metricsFile.empty()){
+    c.exportMetrics(metricsFile, std::chrono::milliseconds(metricsInterval));
+  }
+
+  // A control client that goes away must not take the node down
+  signal(SIGPIPE, SIG_IGN);
+  // Threads inherit the mask, so only sigwait below sees these
+  sigset_t stopSignals;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  if(daemon && !controlPath.empty()){
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+  }
+
   c.start();
 
+  ControlServer control(c);
+  if(!controlPath.empty()){
+    try{
+      control.listen(controlPath);
+    }
+    catch(const std::exception& exp){
+      err(exp.what());
+      c.disconnect();
+      return 1;
+    }
+  }
+
+  if(daemon){
+    if(controlPath.empty()){
+      // stdout carries the replies
+      Logger::setOutput(std::cerr);
+      control.serve(STDIN_FILENO, STDOUT_FILENO);
+    }
+    else{
+      int sig;
+      sigwait(&stopSignals, &sig);
+    }
+    control.stop();
+    c.disconnect();
+    return 0;
+  }
+
   while(true){
     int choice;
-    std::cout<<"\n1.Print Client Ports \n2.Print BlockChain \n3.Add Data \n4.Update Data \n0.Exit \nEnter Choice:";
-    std::cin>>choice;
+    std::cout<<"\n1.Print Client Ports \n2.Print BlockChain \n3.Add Data \n4.Update Data \n5.Verify BlockChain \n6.Print Metrics \n7.Export Snapshot \n8.Import Snapshot \n9.Find Data \n0.Exit \nEnter Choice:";
+    if(!(std::cin>>choice)) choice = 0;
     switch (choice) {
       case 1:
         c.printPeers();
@@ -23,7 +114,7 @@ int main(int argc, char const *argv[]) {
       case 3:{
         std::string data;
         std::cout<<"Enter Data :";
-        std::cin>>data;
+        std::getline(std::cin>>std::ws, data);
         c.addData(data);
         break;
       }
@@ -33,12 +124,56 @@ int main(int argc, char const *argv[]) {
         std::cout<<"Enter Block No:";
         std::cin>>idx;
         std::cout<<"Enter Data :";
-        std::cin>>data;
+        std::getline(std::cin>>std::ws, data);
         c.updateData(idx, data);
+        break;
+      }
+      case 5:
+        std::cout<<(c.verifyChain() ? "BlockChain is valid" : "BlockChain is invalid")<<std::endl;
+        break;
+      case 6:{
+        int format;
+        std::cout<<"Format (1.Text 2.JSON):";
+        std::cin>>format;
+        c.dumpMetrics(std::cout, format == 2);
+        break;
+      }
+      case 7:
+      case 8:{
+        std::string path;
+        std::cout<<"Enter File :";
+        std::getline(std::cin>>std::ws, path);
+        try{
+          if(choice == 7){
+            std::ofstream file(path, std::ios::binary);
+            if(!file) throw std::runtime_error("cannot open " + path);
+            std::cout<<"Exported "<<c.exportSnapshot(file)<<" blocks"<<std::endl;
+          }
+          else{
+            std::ifstream file(path, std::ios::binary);
+            std::cout<<"BlockChain length "<<c.importSnapshot(file)<<std::endl;
+          }
+        }
+        catch(const std::exception& exp){
+          std::cout<<"Snapshot failed : "<<exp.what()<<std::endl;
+        }
+        break;
+      }
+      case 9:{
+        std::string query;
+        std::cout<<"Enter Words :";
+        std::getline(std::cin>>std::ws, query);
+        const auto found = c.findData(query);
+        for(const auto idx : found){
+          std::cout<<idx<<" ";
+        }
+        std::cout<<"("<<found.size()<<" blocks)"<<std::endl;
+        break;
       }
       default:
         break;
       case 0:
+        control.stop();
         c.disconnect();
         return 0;
     }
@@ -0,0 +1,317 @@
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+
+#include <map>
+#include <array>
+#include <cstdio>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <fstream>
+#include <ostream>
+#include <cstdint>
+#include <condition_variable>
+
+static constexpr auto METRIC_SHARDS = 16;
+static constexpr auto CACHE_LINE = 64;
+
+// Each thread updates its own shard, readers sum the shards
+class Counter {
+
+  struct alignas(CACHE_LINE) Shard {
+    std::atomic<std::uint64_t> value{0};
+  };
+
+private:
+
+  std::array<Shard, METRIC_SHARDS> shards;
+
+  inline static std::atomic<unsigned> next_shard{0};
+
+  static unsigned shard(){
+    static thread_local const unsigned slot = next_shard++ % METRIC_SHARDS;
+    return slot;
+  }
+
+public:
+
+  void add(std::uint64_t n = 1){
+    shards[shard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  std::uint64_t value() const {
+    std::uint64_t total = 0;
+    for(const auto& s : shards){
+      total += s.value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+};
+
+class Gauge {
+
+private:
+
+  std::atomic<std::int64_t> current{0};
+
+public:
+
+  void set(std::int64_t v){
+    current.store(v, std::memory_order_relaxed);
+  }
+
+  std::int64_t value() const {
+    return current.load(std::memory_order_relaxed);
+  }
+
+};
+
+// Log-linear buckets in the style of HdrHistogram: values below 16 are exact,
+// above that every power of two is split into 16 sub-buckets (~6% precision)
+class Histogram {
+
+  static constexpr auto SUB_BITS = 4;
+  static constexpr auto SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr auto BUCKETS = 64 * SUB_BUCKETS;
+
+private:
+
+  std::array<std::atomic<std::uint64_t>, BUCKETS> buckets{};
+  Counter total;
+  Counter sum;
+  std::atomic<std::uint64_t> maximum{0};
+
+public:
+
+  void record(std::uint64_t v){
+    buckets[bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+    total.add();
+    sum.add(v);
+    auto seen = maximum.load(std::memory_order_relaxed);
+    while(v > seen && !maximum.compare_exchange_weak(seen, v, std::memory_order_relaxed));
+  }
+
+  void recordSince(std::chrono::steady_clock::time_point start){
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  std::uint64_t count() const {
+    return total.value();
+  }
+
+  double mean() const {
+    const auto n = count();
+    return n ? double(sum.value()) / n : 0;
+  }
+
+  std::uint64_t max() const {
+    return maximum.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t percentile(double p) const {
+    const auto n = count();
+    if(n == 0) return 0;
+    const auto rank = std::uint64_t(p * (n - 1)) + 1;
+    std::uint64_t seen = 0;
+    for(int b = 0; b < BUCKETS; b++){
+      seen += buckets[b].load(std::memory_order_relaxed);
+      if(seen >= rank) return std::min(valueOf(b), max());
+    }
+    return max();
+  }
+
+private:
+
+  static int bucketOf(std::uint64_t v){
+    if(v < SUB_BUCKETS) return v;
+    const int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((v >> shift) & (SUB_BUCKETS - 1));
+  }
+
+  // Midpoint of the bucket's range
+  static std::uint64_t valueOf(int b){
+    if(b < SUB_BUCKETS) return b;
+    const int shift = b / SUB_BUCKETS - 1;
+    const std::uint64_t low = std::uint64_t(SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+    return low + (std::uint64_t(1) << shift) / 2;
+  }
+
+};
+
+// Named metrics. Registration takes a lock, callers keep the returned
+// reference so updates never touch the registry.
+class Metrics {
+
+private:
+
+  std::mutex registry_mutex;
+  std::map<std::string, std::unique_ptr<Counter>> counters;
+  std::map<std::string, std::unique_ptr<Gauge>> gauges;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms;
+
+public:
+
+  Counter& counter(const std::string& name){
+    return get(counters, name);
+  }
+
+  Gauge& gauge(const std::string& name){
+    return get(gauges, name);
+  }
+
+  Histogram& histogram(const std::string& name){
+    return get(histograms, name);
+  }
+
+  void dumpText(std::ostream& out){
+    std::scoped_lock registry_lock(registry_mutex);
+    for(const auto& [name, c] : counters){
+      out << name << " " << c->value() << "\n";
+    }
+    for(const auto& [name, g] : gauges){
+      out << name << " " << g->value() << "\n";
+    }
+    for(const auto& [name, h] : histograms){
+      out << name << " count=" << h->count() << " mean=" << std::uint64_t(h->mean())
+          << " p50=" << h->percentile(0.5) << " p90=" << h->percentile(0.9)
+          << " p99=" << h->percentile(0.99) << " max=" << h->max() << "\n";
+    }
+  }
+
+  void dumpJson(std::ostream& out){
+    std::scoped_lock registry_lock(registry_mutex);
+    out << "{\"counters\": {";
+    const char *sep = "";
+    for(const auto& [name, c] : counters){
+      out << sep << "\"" << name << "\": " << c->value();
+      sep = ", ";
+    }
+    out << "}, \"gauges\": {";
+    sep = "";
+    for(const auto& [name, g] : gauges){
+      out << sep << "\"" << name << "\": " << g->value();
+      sep = ", ";
+    }
+    out << "}, \"histograms\": {";
+    sep = "";
+    for(const auto& [name, h] : histograms){
+      out << sep << "\"" << name << "\": {\"count\": " << h->count() << ", \"mean\": " << std::uint64_t(h->mean())
+          << ", \"p50\": " << h->percentile(0.5) << ", \"p90\": " << h->percentile(0.9)
+          << ", \"p99\": " << h->percentile(0.99) << ", \"max\": " << h->max() << "}";
+      sep = ", ";
+    }
+    out << "}}\n";
+  }
+
+private:
+
+  template<typename T>
+  T& get(std::map<std::string, std::unique_ptr<T>>& metrics, const std::string& name){
+    std::scoped_lock registry_lock(registry_mutex);
+    auto& metric = metrics[name];
+    if(!metric){
+      metric = std::make_unique<T>();
+    }
+    return *metric;
+  }
+
+};
+
+// Mutex wrapper that records how long contended acquisitions waited. The
+// uncontended path is a try_lock alone, it touches neither the clock nor
+// the shared histogram, so wait_ns counts contended acquisitions only.
+template<typename Mutex>
+class TimedMutex {
+
+private:
+
+  Mutex mutex;
+  Histogram& wait_ns;
+
+public:
+
+  explicit TimedMutex(Histogram& _wait_ns) : wait_ns(_wait_ns) {}
+
+  void lock(){
+    if(mutex.try_lock()) return;
+    const auto start = std::chrono::steady_clock::now();
+    mutex.lock();
+    wait_ns.recordSince(start);
+  }
+
+  bool try_lock(){
+    return mutex.try_lock();
+  }
+
+  void unlock(){
+    mutex.unlock();
+  }
+
+  void lock_shared(){
+    if(mutex.try_lock_shared()) return;
+    const auto start = std::chrono::steady_clock::now();
+    mutex.lock_shared();
+    wait_ns.recordSince(start);
+  }
+
+  bool try_lock_shared(){
+    return mutex.try_lock_shared();
+  }
+
+  void unlock_shared(){
+    mutex.unlock_shared();
+  }
+
+};
+
+// Rewrites a JSON dump of the registry to a file at a fixed interval
+class MetricsExporter {
+
+private:
+
+  std::thread exporter;
+  std::mutex stop_mutex;
+  std::condition_variable stop_cv;
+  bool running = false;
+
+public:
+
+  ~MetricsExporter(){
+    stop();
+  }
+
+  void start(Metrics& metrics, const std::string& path, std::chrono::milliseconds interval){
+    stop();
+    running = true;
+    exporter = std::thread([this, &metrics, path, interval](){
+      std::unique_lock stop_lock(stop_mutex);
+      while(running){
+        stop_cv.wait_for(stop_lock, interval, [this](){ return !running; });
+        const auto tmp = path + ".tmp";
+        {
+          std::ofstream file(tmp);
+          metrics.dumpJson(file);
+        }
+        std::rename(tmp.c_str(), path.c_str());
+      }
+    });
+  }
+
+  void stop(){
+    {
+      std::scoped_lock stop_lock(stop_mutex);
+      if(!running) return;
+      running = false;
+    }
+    stop_cv.notify_all();
+    exporter.join();
+  }
+
+};
+
+#endif
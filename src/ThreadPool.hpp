@@ -0,0 +1,144 @@
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Work-stealing pool: each worker owns a deque, pops its newest task and
+// steals the oldest task of another worker when its own deque is empty.
+class ThreadPool {
+
+  using Task = std::function<void()>;
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+private:
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+
+  std::mutex sleep_mutex;
+  std::condition_variable sleep_cv;
+
+  std::atomic<bool> running{false};
+  std::atomic<std::size_t> pending{0};
+  std::atomic<std::size_t> next_worker{0};
+
+  inline static thread_local ThreadPool *current_pool = nullptr;
+  inline static thread_local std::size_t current_worker = 0;
+
+public:
+
+  explicit ThreadPool(std::size_t size = std::max(2u, std::thread::hardware_concurrency())) {
+    for(std::size_t i = 0; i < size; i++){
+      workers.emplace_back(std::make_unique<Worker>());
+    }
+  }
+
+  ~ThreadPool(){
+    stop();
+  }
+
+  void start(){
+    if(running.exchange(true)) return;
+    for(std::size_t i = 0; i < workers.size(); i++){
+      threads.emplace_back([this, i](){ work(i); });
+    }
+  }
+
+  // Runs every queued task to completion, then joins the workers
+  void stop(){
+    if(!running.exchange(false)) return;
+    {
+      std::scoped_lock sleep_lock(sleep_mutex);
+    }
+    sleep_cv.notify_all();
+    for(auto& t : threads){
+      t.join();
+    }
+    threads.clear();
+  }
+
+  auto size() const {
+    return workers.size();
+  }
+
+  // Tasks submitted while the pool is not running are run inline
+  template<typename F>
+  auto submit(F&& fn){
+    using Result = std::invoke_result_t<std::decay_t<F>>;
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(fn));
+    auto future = task->get_future();
+    // Counted before it is queued, so no worker exits on stop() while it is on its way
+    {
+      std::unique_lock sleep_lock(sleep_mutex);
+      if(!running){
+        sleep_lock.unlock();
+        (*task)();
+        return future;
+      }
+      pending++;
+    }
+    const auto w = current_pool == this ? current_worker : next_worker++ % workers.size();
+    {
+      std::scoped_lock worker_lock(workers[w]->mutex);
+      workers[w]->tasks.emplace_back([task](){ (*task)(); });
+    }
+    sleep_cv.notify_one();
+    return future;
+  }
+
+private:
+
+  void work(std::size_t self){
+    current_pool = this;
+    current_worker = self;
+    while(true){
+      Task task;
+      if(pop(self, task) || steal(self, task)){
+        pending--;
+        task();
+        continue;
+      }
+      std::unique_lock sleep_lock(sleep_mutex);
+      sleep_cv.wait(sleep_lock, [this](){ return pending > 0 || !running; });
+      if(!running && pending == 0) break;
+    }
+    current_pool = nullptr;
+  }
+
+  bool pop(std::size_t self, Task& task){
+    std::scoped_lock worker_lock(workers[self]->mutex);
+    if(workers[self]->tasks.empty()) return false;
+    task = std::move(workers[self]->tasks.back());
+    workers[self]->tasks.pop_back();
+    return true;
+  }
+
+  bool steal(std::size_t self, Task& task){
+    for(std::size_t i = 1; i < workers.size(); i++){
+      auto& victim = *workers[(self + i) % workers.size()];
+      std::scoped_lock worker_lock(victim.mutex);
+      if(victim.tasks.empty()) continue;
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+    return false;
+  }
+
+};
+
+#endif
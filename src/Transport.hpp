@@ -0,0 +1,410 @@
+#ifndef __TRANSPORT_HPP__
+#define __TRANSPORT_HPP__
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#include "PracticalSocket.hpp"
+#include "log.h"
+
+static constexpr auto BUFFER_SIZE = 1024*2;
+
+enum class TransportKind {
+  Socket,
+  IoUring
+};
+
+// Datagram transport over one bound UDP socket
+class Transport {
+
+public:
+
+  virtual ~Transport() = default;
+
+  // Sends buffer as one datagram to each address, safe to call from several threads
+  virtual void sendTo(const char *buffer, int len, const sockaddr_in *addrs, std::size_t count) = 0;
+
+  // Calls on_datagram for each datagram received until running is false
+  virtual void receive(const std::function<void(const char*, int)>& on_datagram, const std::atomic<bool>& running) = 0;
+
+  // Wakes a thread blocked in receive
+  virtual void shutdown() = 0;
+
+};
+
+// Non-blocking recv on sock, polled while it is idle
+inline void pollReceive(UDPSocket& sock, const std::function<void(const char*, int)>& on_datagram, const std::atomic<bool>& running){
+  char buffer[BUFFER_SIZE];
+  while(running){
+    const int size = sock.recv(buffer, BUFFER_SIZE, MSG_DONTWAIT);
+    if(size < 0 && errno == EAGAIN){
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      continue;
+    }
+    if(size <= 0){
+      break;
+    }
+    on_datagram(buffer, size);
+  }
+}
+
+// One sendto or recv per datagram
+class SocketTransport : public Transport {
+
+private:
+
+  std::unique_ptr<UDPSocket> sock;
+
+public:
+
+  explicit SocketTransport(UDPSocket *_sock) : sock(_sock) {}
+
+  void sendTo(const char *buffer, int len, const sockaddr_in *addrs, std::size_t count) override {
+    for(std::size_t i = 0; i < count; i++){
+      sock->sendTo(buffer, len, addrs[i]);
+    }
+  }
+
+  void receive(const std::function<void(const char*, int)>& on_datagram, const std::atomic<bool>& running) override {
+    pollReceive(*sock, on_datagram, running);
+  }
+
+  void shutdown() override {
+    sock->shutdown();
+  }
+
+};
+
+#ifdef HAVE_IO_URING
+
+// Datagrams received into this many kernel-selected buffers per socket
+static constexpr auto URING_RECV_BUFFERS = 256;
+// Submission slots, also the largest batch of sends per io_uring_enter
+static constexpr auto URING_ENTRIES = 64;
+// Longest a receiver waits before checking whether it should stop
+static constexpr auto URING_WAIT_TIMEOUT = std::chrono::milliseconds(50);
+
+// Submission and completion rings of one io_uring instance, set up with raw syscalls
+class UringQueue {
+
+private:
+
+  int ring_fd = -1;
+  void *sq_ring = MAP_FAILED;
+  void *cq_ring = MAP_FAILED;
+  std::size_t sq_ring_size = 0;
+  std::size_t cq_ring_size = 0;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  std::size_t sqes_size = 0;
+
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+  unsigned sq_entries = 0;
+  unsigned ring_features = 0;
+  unsigned pending = 0;
+
+public:
+
+  // Throws std::runtime_error if the kernel has no io_uring
+  explicit UringQueue(unsigned entries){
+    io_uring_params params{};
+    ring_fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if(ring_fd < 0){
+      throw std::runtime_error(std::string("io_uring_setup : ") + std::strerror(errno));
+    }
+    sq_entries = params.sq_entries;
+    ring_features = params.features;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if(sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED){
+      const auto reason = std::string("io_uring mmap : ") + std::strerror(errno);
+      release();
+      throw std::runtime_error(reason);
+    }
+    auto *sq = static_cast<char*>(sq_ring);
+    auto *cq = static_cast<char*>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  UringQueue(const UringQueue&) = delete;
+  UringQueue& operator=(const UringQueue&) = delete;
+
+  ~UringQueue(){
+    release();
+  }
+
+  unsigned capacity() const {
+    return sq_entries;
+  }
+
+  unsigned features() const {
+    return ring_features;
+  }
+
+  // Zeroed entry, published by the next submit. At most capacity() between submits.
+  io_uring_sqe& next(){
+    const auto tail = *sq_tail + pending++;
+    const auto slot = tail & *sq_mask;
+    sq_array[slot] = slot;
+    auto& sqe = sqes[slot];
+    std::memset(&sqe, 0, sizeof(sqe));
+    return sqe;
+  }
+
+  // Publishes the prepared entries and waits for at least wait completions
+  void submit(unsigned wait){
+    const auto submitted = pending;
+    __atomic_store_n(sq_tail, *sq_tail + pending, __ATOMIC_RELEASE);
+    pending = 0;
+    while(::syscall(__NR_io_uring_enter, ring_fd, submitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0){
+      if(errno != EINTR){
+        throw std::runtime_error(std::string("io_uring_enter : ") + std::strerror(errno));
+      }
+    }
+  }
+
+  // Like submit(1), but gives up waiting after timeout
+  void submitAndWait(std::chrono::milliseconds timeout){
+    const auto submitted = pending;
+    __atomic_store_n(sq_tail, *sq_tail + pending, __ATOMIC_RELEASE);
+    pending = 0;
+    __kernel_timespec ts{0, std::chrono::nanoseconds(timeout).count()};
+    io_uring_getevents_arg arg{};
+    arg.ts = reinterpret_cast<__u64>(&ts);
+    if(::syscall(__NR_io_uring_enter, ring_fd, submitted, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0){
+      if(errno != ETIME && errno != EINTR){
+        throw std::runtime_error(std::string("io_uring_enter : ") + std::strerror(errno));
+      }
+    }
+  }
+
+  // Calls fn on each available completion, returns how many there were
+  unsigned reap(auto&& fn){
+    auto head = *cq_head;
+    const auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    const auto count = tail - head;
+    for(; head != tail; head++){
+      fn(cqes[head & *cq_mask]);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+private:
+
+  void release(){
+    if(sqes != MAP_FAILED) ::munmap(sqes, sqes_size);
+    if(cq_ring != MAP_FAILED) ::munmap(cq_ring, cq_ring_size);
+    if(sq_ring != MAP_FAILED) ::munmap(sq_ring, sq_ring_size);
+    if(ring_fd >= 0) ::close(ring_fd);
+  }
+
+};
+
+// Receives with one multishot recv into a group of buffers provided to the
+// kernel up front, so a busy socket delivers many datagrams per
+// io_uring_enter. Consumed buffers are handed back with the next enter.
+// Broadcasts are submitted as one batch of sendmsg operations.
+class UringTransport : public Transport {
+
+  static constexpr __u16 BUFFER_GROUP = 0;
+  static constexpr __u64 RECV_TAG = 1;
+  static constexpr __u64 PROVIDE_TAG = 2;
+
+private:
+
+  UringQueue recv_queue{URING_ENTRIES};
+  std::vector<char> buffers;
+  // Buffers consumed since the last enter
+  std::vector<__u16> returned;
+
+  std::mutex send_mutex;
+  UringQueue send_queue{URING_ENTRIES};
+
+  std::unique_ptr<UDPSocket> sock;
+
+public:
+
+  // Takes ownership of sock on success. Throws std::runtime_error, leaving
+  // sock to the caller, if io_uring or buffer selection is unavailable.
+  explicit UringTransport(UDPSocket *_sock) : buffers(std::size_t(URING_RECV_BUFFERS) * BUFFER_SIZE) {
+    if(!(recv_queue.features() & IORING_FEAT_EXT_ARG)){
+      throw std::runtime_error("io_uring without timed waits");
+    }
+    provide(0, URING_RECV_BUFFERS);
+    recv_queue.submit(1);
+    int result = 0;
+    recv_queue.reap([&result](const io_uring_cqe& cqe){ result = cqe.res; });
+    if(result < 0){
+      throw std::runtime_error(std::string("provide buffers : ") + std::strerror(-result));
+    }
+    returned.reserve(URING_RECV_BUFFERS);
+    sock.reset(_sock);
+  }
+
+  // Single datagrams go straight to sendto, which is as cheap as one enter.
+  // While another thread owns the send queue, sends take that path too.
+  void sendTo(const char *buffer, int len, const sockaddr_in *addrs, std::size_t count) override {
+    std::unique_lock send_lock(send_mutex, std::defer_lock);
+    if(count < 2 || !send_lock.try_lock()){
+      for(std::size_t i = 0; i < count; i++){
+        sock->sendTo(buffer, len, addrs[i]);
+      }
+      return;
+    }
+    iovec iov{const_cast<char*>(buffer), std::size_t(len)};
+    std::vector<msghdr> msgs(std::min<std::size_t>(count, send_queue.capacity()));
+    for(std::size_t sent = 0; sent < count;){
+      const auto batch = std::min<std::size_t>(count - sent, msgs.size());
+      for(std::size_t i = 0; i < batch; i++){
+        msgs[i] = msghdr{};
+        msgs[i].msg_name = const_cast<sockaddr_in*>(&addrs[sent + i]);
+        msgs[i].msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_iov = &iov;
+        msgs[i].msg_iovlen = 1;
+        auto& sqe = send_queue.next();
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.fd = sock->getDescriptor();
+        sqe.addr = reinterpret_cast<__u64>(&msgs[i]);
+        sqe.len = 1;
+      }
+      send_queue.submit(batch);
+      int failure = 0;
+      for(std::size_t done = 0; done < batch;){
+        done += send_queue.reap([&failure, len](const io_uring_cqe& cqe){
+          if(cqe.res != len) failure = cqe.res < 0 ? -cqe.res : EMSGSIZE;
+        });
+      }
+      if(failure){
+        errno = failure;
+        throw SocketException("Send failed (io_uring sendmsg)", true);
+      }
+      sent += batch;
+    }
+  }
+
+  void receive(const std::function<void(const char*, int)>& on_datagram, const std::atomic<bool>& running) override {
+    bool armed = false;
+    bool multishot = true;
+    while(running && multishot){
+      if(!armed){
+        arm();
+        armed = true;
+      }
+      recv_queue.submitAndWait(URING_WAIT_TIMEOUT);
+      recv_queue.reap([&](const io_uring_cqe& cqe){
+        if(cqe.user_data != RECV_TAG) return;
+        if(!(cqe.flags & IORING_CQE_F_MORE)) armed = false;
+        if(cqe.res == -EINVAL) multishot = false;
+        if(!(cqe.flags & IORING_CQE_F_BUFFER)) return;
+        const __u16 bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if(cqe.res > 0) on_datagram(&buffers[std::size_t(bid) * BUFFER_SIZE], cqe.res);
+        returned.push_back(bid);
+      });
+      recycle(armed ? 0 : 1);
+    }
+    if(!multishot){
+      err("multishot recv unsupported, polling the socket");
+      pollReceive(*sock, on_datagram, running);
+    }
+  }
+
+  // receive notices within URING_WAIT_TIMEOUT
+  void shutdown() override {
+    sock->shutdown();
+  }
+
+private:
+
+  // Queues buffers [bid, bid + count) for the kernel to receive into
+  void provide(__u16 bid, unsigned count){
+    auto& sqe = recv_queue.next();
+    sqe.opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe.fd = count;
+    sqe.addr = reinterpret_cast<__u64>(&buffers[std::size_t(bid) * BUFFER_SIZE]);
+    sqe.len = BUFFER_SIZE;
+    sqe.off = bid;
+    sqe.buf_group = BUFFER_GROUP;
+    sqe.user_data = PROVIDE_TAG;
+  }
+
+  // Queues the consumed buffers, runs of consecutive ones as one entry,
+  // keeping reserve entries free for the caller
+  void recycle(unsigned reserve){
+    std::sort(returned.begin(), returned.end());
+    unsigned queued = 0;
+    for(std::size_t i = 0; i < returned.size();){
+      auto j = i + 1;
+      while(j < returned.size() && returned[j] == returned[j - 1] + 1) j++;
+      if(queued + reserve == recv_queue.capacity()){
+        recv_queue.submit(0);
+        queued = 0;
+      }
+      provide(returned[i], j - i);
+      queued++;
+      i = j;
+    }
+    returned.clear();
+  }
+
+  void arm(){
+    auto& sqe = recv_queue.next();
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = sock->getDescriptor();
+    sqe.ioprio = IORING_RECV_MULTISHOT;
+    sqe.flags = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = BUFFER_GROUP;
+    sqe.user_data = RECV_TAG;
+  }
+
+};
+
+#endif
+
+// The requested transport on sock, or SocketTransport if the kernel cannot provide it
+inline std::unique_ptr<Transport> openTransport(UDPSocket *sock, TransportKind kind){
+#ifdef HAVE_IO_URING
+  if(kind == TransportKind::IoUring){
+    try{
+      return std::make_unique<UringTransport>(sock);
+    }
+    catch(const std::runtime_error& exp){
+      err("io_uring unavailable, using sockets : " << exp.what());
+    }
+  }
+#endif
+  return std::make_unique<SocketTransport>(sock);
+}
+
+#endif
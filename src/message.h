@@ -2,6 +2,7 @@
 #define __MESSAGES_H__
 
 #include "BlockChain/Block.hpp"
+#include "BlockChain/BodyStore.hpp"
 
 enum MessageType{
   ConnectMsg,
@@ -10,9 +11,36 @@ enum MessageType{
   ResponseChashMsg,
   RequestDataMsg,
   ResponseDataMsg,
-  DisconnectMsg
+  DisconnectMsg,
+  BulkSyncRequestMsg,
+  BulkSyncEndMsg,
+  RequestDigestMsg,
+  ResponseDigestMsg,
+  ResponseHeaderMsg,
+  RequestBodyMsg,
+  ResponseBodyMsg
 };
 
+static constexpr const char *MESSAGE_TYPE_NAMES[] = {
+  "ConnectMsg",
+  "ConnectAcknowledgementMsg",
+  "RequestChashMsg",
+  "ResponseChashMsg",
+  "RequestDataMsg",
+  "ResponseDataMsg",
+  "DisconnectMsg",
+  "BulkSyncRequestMsg",
+  "BulkSyncEndMsg",
+  "RequestDigestMsg",
+  "ResponseDigestMsg",
+  "ResponseHeaderMsg",
+  "RequestBodyMsg",
+  "ResponseBodyMsg"
+};
+
+static constexpr auto MESSAGE_TYPES = sizeof(MESSAGE_TYPE_NAMES) / sizeof(MESSAGE_TYPE_NAMES[0]);
+static_assert(MessageType::ResponseBodyMsg + 1 == MESSAGE_TYPES, "MESSAGE_TYPE_NAMES must name every MessageType");
+
 struct MessageHeader{
   unsigned int packetSize;
   MessageType msgType;
@@ -40,6 +68,7 @@ struct RequestChashMessage{
 struct ResponseChashMessage{
   MessageHeader header;
   Idx idx;
+  Idx length;
   char chash[HASH_SIZE];
 };
 
@@ -53,21 +82,93 @@ struct ResponseDataMessage{
   MessageHeader header;
   Idx idx;
   Nonce nonce;
+  Timestamp timestamp;
+  Difficulty difficulty;
   char phash[HASH_SIZE];
   char chash[HASH_SIZE];
   char data[DATA_SIZE];
 };
 
+// Bulk sync frames travel over TCP. Blocks are streamed as ResponseHeaderMessage,
+// then the receiver asks once for each body it does not hold by its digest and
+// ends the requests with a BulkSyncEndMessage, which the sender echoes back.
+struct BulkSyncRequestMessage{
+  MessageHeader header;
+  Idx from;
+  Idx to;
+};
+
+struct BulkSyncEndMessage{
+  MessageHeader header;
+  Idx next;
+};
+
+struct ResponseHeaderMessage{
+  MessageHeader header;
+  Idx idx;
+  Nonce nonce;
+  Timestamp timestamp;
+  Difficulty difficulty;
+  char phash[HASH_SIZE];
+  char chash[HASH_SIZE];
+  unsigned char body[DIGEST_SIZE];
+};
+
+struct RequestBodyMessage{
+  MessageHeader header;
+  unsigned char digest[DIGEST_SIZE];
+};
+
+struct ResponseBodyMessage{
+  MessageHeader header;
+  unsigned char digest[DIGEST_SIZE];
+  char data[DATA_SIZE];
+};
+
+// Digest of the chashes of blocks [0, length), compared to find where two chains diverge
+struct RequestDigestMessage{
+  MessageHeader header;
+  Idx length;
+};
+
+// length is clamped to the responder's chain, chainLength is that chain's length
+struct ResponseDigestMessage{
+  MessageHeader header;
+  Idx length;
+  Idx chainLength;
+  char digest[DIGEST_SIZE];
+};
+
 struct chash_response {
   Idx idx;
   unsigned short port;
+  Idx length;
+  std::string chash;
+};
+
+struct digest_response {
+  Idx length;
+  unsigned short port;
+  Idx chainLength;
+  std::string digest;
+};
+
+struct header_response {
+  Idx idx;
+  Nonce nonce;
+  Timestamp timestamp;
+  Difficulty difficulty;
+  std::string phash;
   std::string chash;
+  BodyDigest body;
 };
 
 struct data_response {
   Idx idx;
   unsigned short port;
   Nonce nonce;
+  Timestamp timestamp;
+  Difficulty difficulty;
   std::string phash;
   std::string chash;
   std::string data;